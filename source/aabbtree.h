@@ -0,0 +1,476 @@
+#ifndef AABB_TREE
+#define AABB_TREE
+
+#include <mutex>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+
+#include "threadpool.h"
+
+/*
+ * Node of the tree. Leaves store an entity, inner nodes the union of their
+ * children. Leaf bounds are fattened so small movements do not need a
+ * reinsertion.
+ */
+struct AABBNode {
+	float x1, y1;
+	float x2, y2;
+
+	// entity of a leaf
+	int eid;
+
+	// -1 is null
+	int parent;
+	int left;
+	int right;
+
+	// leaves have height 0, free nodes -1
+	int height;
+
+	bool leaf(void) {
+		return left == -1;
+	};
+};
+
+/*
+ * Dynamic bounding volume hierarchy.
+ *
+ * A new leaf is placed next to the sibling which grows the total perimeter
+ * (the surface area heuristic in 2D) the least, and the path back to the
+ * root is rebalanced with AVL rotations.
+ *
+ * update first checks whether the entity is still inside its fat bounds,
+ * which needs no lock. Only entities that escaped are reinserted, under a
+ * coarse mutex. Node storage is allocated up front so lock-free readers
+ * never see it move.
+ */
+class AABBTree {
+	std::vector<AABBNode> nodes;
+
+	int root;
+
+	// singly linked list of free nodes through parent
+	int free;
+
+	// margin added to every side of a leaf
+	float margin;
+
+	std::mutex mtx;
+
+	/*
+	 * take a node from the free list, a tree of n leaves needs 2n - 1
+	 * nodes so the pool can not run out
+	 */
+	int allocateNode(void) {
+		auto index = free;
+		auto &node = nodes[index];
+		free = node.parent;
+
+		node.parent = -1;
+		node.left = -1;
+		node.right = -1;
+		node.height = 0;
+		node.eid = -1;
+		return index;
+	};
+
+	/*
+	 * return a node to the free list
+	 */
+	void freeNode(int index) {
+		nodes[index].parent = free;
+		nodes[index].height = -1;
+		free = index;
+	};
+
+	/*
+	 * perimeter of the union of two nodes
+	 */
+	float perimeter(AABBNode &a, AABBNode &b) {
+		auto w = std::max(a.x2, b.x2) - std::min(a.x1, b.x1);
+		auto h = std::max(a.y2, b.y2) - std::min(a.y1, b.y1);
+		return 2.0f * (w + h);
+	};
+
+	float perimeter(AABBNode &a) {
+		return 2.0f * (a.x2 - a.x1 + a.y2 - a.y1);
+	};
+
+	/*
+	 * refit a node to its children
+	 */
+	void refit(int index) {
+		auto &node = nodes[index];
+		auto &a = nodes[node.left];
+		auto &b = nodes[node.right];
+
+		node.x1 = std::min(a.x1, b.x1);
+		node.y1 = std::min(a.y1, b.y1);
+		node.x2 = std::max(a.x2, b.x2);
+		node.y2 = std::max(a.y2, b.y2);
+		node.height = 1 + std::max(a.height, b.height);
+	};
+
+	bool overlap(AABBNode &a, AABBNode &b) {
+		if (a.x1 > b.x2 || b.x1 > a.x2) return false;
+		if (a.y1 > b.y2 || b.y1 > a.y2) return false;
+		return true;
+	};
+
+	/*
+	 * replace child old_child of parent with new_child, parent may be null
+	 */
+	void replaceChild(int parent, int old_child, int new_child) {
+		if (parent == -1) {
+			root = new_child;
+		} else if (nodes[parent].left == old_child) {
+			nodes[parent].left = new_child;
+		} else {
+			nodes[parent].right = new_child;
+		}
+	};
+
+	/*
+	 * rotate the taller grandchild of a up if a is unbalanced.
+	 *
+	 * returns the node which now sits at the position of a
+	 */
+	int balance(int ia) {
+		auto &a = nodes[ia];
+		if (a.leaf() || a.height < 2) return ia;
+
+		auto ib = a.left;
+		auto ic = a.right;
+		auto diff = nodes[ic].height - nodes[ib].height;
+
+		// right side too high, rotate c up
+		if (diff > 1) {
+			auto &c = nodes[ic];
+			auto if_ = c.left;
+			auto ig = c.right;
+
+			c.left = ia;
+			c.parent = a.parent;
+			a.parent = ic;
+			replaceChild(c.parent, ia, ic);
+
+			// keep the taller grandchild under c
+			if (nodes[if_].height > nodes[ig].height) {
+				c.right = if_;
+				a.right = ig;
+				nodes[ig].parent = ia;
+			} else {
+				c.right = ig;
+				a.right = if_;
+				nodes[if_].parent = ia;
+			}
+			refit(ia);
+			refit(ic);
+			return ic;
+		}
+
+		// left side too high, rotate b up
+		if (diff < -1) {
+			auto &b = nodes[ib];
+			auto id = b.left;
+			auto ie = b.right;
+
+			b.left = ia;
+			b.parent = a.parent;
+			a.parent = ib;
+			replaceChild(b.parent, ia, ib);
+
+			if (nodes[id].height > nodes[ie].height) {
+				b.right = id;
+				a.left = ie;
+				nodes[ie].parent = ia;
+			} else {
+				b.right = ie;
+				a.left = id;
+				nodes[id].parent = ia;
+			}
+			refit(ia);
+			refit(ib);
+			return ib;
+		}
+
+		return ia;
+	};
+
+	/*
+	 * refit and rebalance every node from index to the root
+	 */
+	void fixUpwards(int index) {
+		while (index != -1) {
+			index = balance(index);
+			refit(index);
+			index = nodes[index].parent;
+		}
+	};
+
+	void insertLeaf(int leaf) {
+		if (root == -1) {
+			root = leaf;
+			nodes[leaf].parent = -1;
+			return;
+		}
+
+		// greedy descent on perimeter cost, stops where a new parent is
+		// cheaper than going further down
+		auto &l = nodes[leaf];
+		auto index = root;
+		while (!nodes[index].leaf()) {
+			auto &node = nodes[index];
+			auto combined = perimeter(node, l);
+
+			// cost of a new parent for this node and leaf
+			auto cost = 2.0f * combined;
+
+			// minimum cost pushed down to the children
+			auto inherited = 2.0f * (combined - perimeter(node));
+
+			auto &a = nodes[node.left];
+			auto &b = nodes[node.right];
+			auto cost_a = perimeter(a, l) + inherited;
+			auto cost_b = perimeter(b, l) + inherited;
+			if (!a.leaf()) cost_a -= perimeter(a);
+			if (!b.leaf()) cost_b -= perimeter(b);
+
+			if (cost < cost_a && cost < cost_b) break;
+			index = cost_a < cost_b ? node.left : node.right;
+		}
+
+		auto sibling = index;
+		auto old_parent = nodes[sibling].parent;
+		auto parent = allocateNode();
+
+		nodes[parent].parent = old_parent;
+		nodes[parent].left = sibling;
+		nodes[parent].right = leaf;
+		nodes[sibling].parent = parent;
+		nodes[leaf].parent = parent;
+		replaceChild(old_parent, sibling, parent);
+
+		fixUpwards(parent);
+	};
+
+	void removeLeaf(int leaf) {
+		if (leaf == root) {
+			root = -1;
+			return;
+		}
+
+		auto parent = nodes[leaf].parent;
+		auto grand_parent = nodes[parent].parent;
+		auto sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+		// sibling takes the place of the parent
+		replaceChild(grand_parent, parent, sibling);
+		nodes[sibling].parent = grand_parent;
+		freeNode(parent);
+
+		fixUpwards(grand_parent);
+	};
+
+	/*
+	 * report all overlapping leaves between two subtrees
+	 */
+	void cross(int ia, int ib, std::function<void(int,int)> &func) {
+		auto &a = nodes[ia];
+		auto &b = nodes[ib];
+		if (!overlap(a, b)) return;
+
+		if (a.leaf() && b.leaf()) {
+			func(a.eid, b.eid);
+		} else if (b.leaf() || (!a.leaf() && a.height >= b.height)) {
+			cross(a.left, ib, func);
+			cross(a.right, ib, func);
+		} else {
+			cross(ia, b.left, func);
+			cross(ia, b.right, func);
+		}
+	};
+
+	/*
+	 * report all overlapping leaves within a subtree
+	 */
+	void self(int index, std::function<void(int,int)> &func) {
+		auto &node = nodes[index];
+		if (node.leaf()) return;
+
+		self(node.left, func);
+		self(node.right, func);
+		cross(node.left, node.right, func);
+	};
+
+	public:
+
+	/*
+	 * max_entities is the number of leaves the tree can hold
+	 */
+	AABBTree(float m, int max_entities = 102400) {
+		margin = m;
+		root = -1;
+		free = -1;
+
+		nodes.resize(2 * max_entities);
+		for (int i = nodes.size() - 1; i >= 0; i--) freeNode(i);
+	};
+
+	/*
+     * Insert an entity into the tree
+	 *
+	 * Input is an EntityID and an AABB bounding box representing the object.
+	 * the function assumes x1, y1 is less than x2, y2.
+	 *
+ 	 * returns the leaf used as handle
+     */
+	int add(int eid, float x1, float y1, float x2, float y2) {
+		std::lock_guard<std::mutex> lock(mtx);
+
+		auto leaf = allocateNode();
+		auto &node = nodes[leaf];
+		node.eid = eid;
+		node.x1 = x1 - margin;
+		node.y1 = y1 - margin;
+		node.x2 = x2 + margin;
+		node.y2 = y2 + margin;
+
+		insertLeaf(leaf);
+		return leaf;
+	};
+
+	/*
+     * remove an entity, the handle becomes invalid
+     */
+	void remove(int leaf) {
+		std::lock_guard<std::mutex> lock(mtx);
+
+		removeLeaf(leaf);
+		freeNode(leaf);
+	};
+
+	/*
+	 * Move an entity to a new AABB.
+	 *
+	 * dx, dy is the expected displacement until the next update, the fat
+	 * bounds are stretched in that direction.
+	 *
+	 * returns true if the entity left its fat bounds and was reinserted
+	 */
+	bool update(int leaf, float x1, float y1, float x2, float y2, float dx = 0.0f, float dy = 0.0f) {
+		auto &node = nodes[leaf];
+
+		// still inside fat bounds, nothing to do
+		if (node.x1 <= x1 && node.y1 <= y1 && x2 <= node.x2 && y2 <= node.y2) {
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(mtx);
+
+		removeLeaf(leaf);
+
+		node.x1 = x1 - margin + std::min(dx, 0.0f);
+		node.y1 = y1 - margin + std::min(dy, 0.0f);
+		node.x2 = x2 + margin + std::max(dx, 0.0f);
+		node.y2 = y2 + margin + std::max(dy, 0.0f);
+
+		insertLeaf(leaf);
+		return true;
+	};
+
+	/*
+     * query possible collisions from a given handle
+     */
+	void query_callback(int leaf, std::function<void(int,int)> func) {
+		if (root == -1) return;
+
+		auto &node = nodes[leaf];
+
+		// stack of nodes to visit, deep enough for a balanced tree
+		int stack[256];
+		int top = 0;
+		stack[top++] = root;
+
+		while (top) {
+			auto index = stack[--top];
+			auto &curr = nodes[index];
+			if (!overlap(node, curr)) continue;
+
+			if (curr.leaf()) {
+				// ignore symmetric collisons and collisions with self
+				if (curr.eid > node.eid) func(node.eid, curr.eid);
+			} else {
+				stack[top++] = curr.left;
+				stack[top++] = curr.right;
+			}
+		}
+	};
+
+	/*
+     * report every overlapping pair of leaves once, in parallel.
+	 *
+	 * the self overlap of the root is split into independent subtree self
+	 * and subtree cross traversals until there are enough of them, then
+	 * every traversal becomes one task.
+     */
+	void query_all(ThreadPool &pool, std::function<void(int,int)> func, int tasks = 64) {
+		if (root == -1) return;
+
+		// pairs of subtrees, a == b is a self traversal
+		std::vector<std::pair<int,int>> work;
+		work.emplace_back(root, root);
+
+		for (int i = 0; i < (int) work.size() && (int) work.size() < tasks; ) {
+			auto a = work[i].first;
+			auto b = work[i].second;
+			auto &na = nodes[a];
+			auto &nb = nodes[b];
+
+			if (a == b && !na.leaf()) {
+				work[i] = std::make_pair(na.left, na.left);
+				work.emplace_back(na.right, na.right);
+				work.emplace_back(na.left, na.right);
+			} else if (a != b && !na.leaf() && overlap(na, nb)) {
+				work[i] = std::make_pair(na.left, b);
+				work.emplace_back(na.right, b);
+			} else {
+				i++;
+			}
+		}
+
+		for (auto &w : work) {
+			auto a = w.first;
+			auto b = w.second;
+			pool.add([this, a, b, func] {
+				auto f = func;
+				if (a == b) self(a, f);
+				else cross(a, b, f);
+			}, "AABBTree::query_all");
+		}
+		pool.wait("AABBTree::query_all");
+	};
+
+	/*
+	 * height of the tree, 0 for a single leaf
+	 */
+	int height(void) {
+		return root == -1 ? 0 : nodes[root].height;
+	};
+
+	/*
+     * print the leaves of the tree
+     */
+	void print(void) {
+		for (int i = 0; i < (int) nodes.size(); i++) {
+			auto &node = nodes[i];
+			if (node.height != 0) continue;
+			std::cout << node.eid << " @ " << node.x1 << ", " << node.y1;
+			std::cout << " to " << node.x2 << ", " << node.y2 << std::endl;
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef BUMP_ARENA
+#define BUMP_ARENA
+
+#include <atomic>
+#include <array>
+#include <vector>
+
+#include "threadslot.h"
+
+/*
+ * Objects handed out by bumping a pointer through blocks owned by each
+ * thread.
+ *
+ * Objects are never freed one by one, reset returns all of them at once.
+ * Blocks are allocated the first time they are needed and kept for the
+ * next frame, so memory grows with the largest number of objects in use
+ * between two resets.
+ */
+template<class T, int BLOCK = 1024, int MAX_BLOCKS = 16384>
+class BumpArena {
+	// block owned by a thread, next == end when used up
+	struct alignas(64) Slot {
+		T *next;
+		T *end;
+	};
+
+	std::array<Slot, MAX_THREAD_SLOTS> slots;
+
+	// blocks are handed out in order, each index is only written by the
+	// thread which took it
+	std::vector<T*> blocks;
+
+	// number of blocks handed out since the last reset
+	std::atomic<int> used;
+
+	public:
+
+	BumpArena() : blocks(MAX_BLOCKS, nullptr) {
+		used.store(0);
+		reset();
+	};
+
+	~BumpArena() {
+		for (auto *block : blocks) delete[] block;
+	};
+
+	/*
+     * object owned by the caller until reset, its contents are left over
+	 * from earlier frames
+     */
+	T* allocate(void) {
+		auto &slot = slots[thread_slot()];
+		if (slot.next == slot.end) {
+			int b;
+			while (true) {
+				b = used.load();
+
+				// Warning - out of blocks, waits for a reset which never comes
+				if (b >= MAX_BLOCKS) continue;
+
+				bool s = used.compare_exchange_strong(b, b + 1);
+				if (s) break;
+			}
+
+			if (!blocks[b]) blocks[b] = new T[BLOCK];
+			slot.next = blocks[b];
+			slot.end = blocks[b] + BLOCK;
+		}
+		return slot.next++;
+	};
+
+	/*
+     * every object becomes unused. Must not run concurrently with allocate.
+     */
+	void reset(void) {
+		for (auto &slot : slots) {
+			slot.next = nullptr;
+			slot.end = nullptr;
+		}
+		used.store(0);
+	};
+
+	/*
+     * number of objects the allocated blocks can hold
+     */
+	long capacity(void) {
+		long n = 0;
+		for (auto *block : blocks) {
+			if (block) n += BLOCK;
+		}
+		return n;
+	};
+};
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Benchmark of the coarse, fine-grained, lock-free and hashed grids
+ *
+ * Every variant rebuilds the grid each frame from moving entities and
+ * queries it, for a range of thread counts and densities. Times are per
+ * frame, pairs is the number of overlapping AABBs found over all frames and
+ * must be the same for every variant. candidates is the number of pairs
+ * reported by the grid per frame.
+ *
+ * The last scenes spread entities over a 1e6 x 1e6 world, where the fixed
+ * tables of the other grids wrap around.
+ *
+ * usage: bench_grid [frames] [max threads]
+ */
+
+#include <atomic>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <algorithm>
+
+#include "grid_coarse.h"
+#include "grid_fine.h"
+#include "grid_lockfree.h"
+#include "grid_hash.h"
+#include "threadpool.h"
+
+// size of the world and of the entities
+float world = 1000.0f;
+const float SIZE = 10.0f;
+
+// entities per task
+const int CHUNK = 64;
+
+struct entity {
+	float x, y;
+	float vx, vy;
+};
+
+struct timing {
+	double add;
+	double query;
+	double clear;
+	long pairs;
+	long candidates;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/*
+ * the coarse grid is told the eid, the other grids store it in their
+ * reference lists
+ */
+void query(GridC &grid, GridReferenceC *ref, int eid, std::function<void(int,int)> &func) {
+	grid.query_callback(ref, eid, func);
+}
+
+template<class Grid, class Ref>
+void query(Grid &grid, Ref *ref, int, std::function<void(int,int)> &func) {
+	grid.query_callback(ref, func);
+}
+
+/*
+ * move entities and bounce them off the edges of the world
+ */
+void move(std::vector<entity> &entities) {
+	for (auto &e : entities) {
+		e.x += e.vx;
+		e.y += e.vy;
+		if (e.x < SIZE || e.x > world - SIZE) e.vx *= -1.0f;
+		if (e.y < SIZE || e.y > world - SIZE) e.vy *= -1.0f;
+	}
+}
+
+template<class Grid, class Ref>
+timing run(Grid &grid, ThreadPool &pool, std::vector<entity> entities, int frames) {
+	timing t = {0.0, 0.0, 0.0, 0, 0};
+	std::vector<Ref*> refs(entities.size());
+	std::atomic<long> pairs(0);
+	std::atomic<long> candidates(0);
+	int n = entities.size();
+
+	// count pairs whose AABBs overlap
+	std::function<void(int,int)> func = [&](int a, int b) {
+		candidates.fetch_add(1, std::memory_order_relaxed);
+		if (std::fabs(entities[a].x - entities[b].x) > SIZE) return;
+		if (std::fabs(entities[a].y - entities[b].y) > SIZE) return;
+		pairs.fetch_add(1, std::memory_order_relaxed);
+	};
+
+	for (int frame = 0; frame < frames; frame++) {
+		move(entities);
+
+		auto start = Clock::now();
+		for (int begin = 0; begin < n; begin += CHUNK) {
+			pool.add([&, begin] {
+				for (int i = begin; i < std::min(begin + CHUNK, n); i++) {
+					auto &e = entities[i];
+					auto half = SIZE * 0.5f;
+					refs[i] = grid.add(i, e.x - half, e.y - half, e.x + half, e.y + half);
+				}
+			});
+		}
+		pool.wait();
+		t.add += elapsed(start);
+
+		start = Clock::now();
+		for (int begin = 0; begin < n; begin += CHUNK) {
+			pool.add([&, begin] {
+				for (int i = begin; i < std::min(begin + CHUNK, n); i++) {
+					query(grid, refs[i], i, func);
+				}
+			});
+		}
+		pool.wait();
+		t.query += elapsed(start);
+
+		start = Clock::now();
+		for (int i = 0; i < n; i++) grid.returnRefNodes(refs[i]);
+		grid.clear();
+		t.clear += elapsed(start);
+	}
+
+	t.add /= frames;
+	t.query /= frames;
+	t.clear /= frames;
+	t.pairs = pairs.load();
+	t.candidates = candidates.load() / frames;
+	return t;
+}
+
+void report(const char *name, int threads, int n, timing t) {
+	printf("%-6s %7d %8d %9.3f %9.3f %9.3f %9.3f %10ld %10ld\n", name, threads, n,
+			t.add, t.query, t.clear, t.add + t.query + t.clear, t.pairs, t.candidates);
+}
+
+/*
+ * entities spread over the whole world, 0 seeded
+ */
+std::vector<entity> spawn(int n) {
+	std::mt19937 mt(0);
+	std::uniform_real_distribution<float> dist_p(SIZE, world - SIZE);
+	std::uniform_real_distribution<float> dist_v(-2.0f, 2.0f);
+
+	std::vector<entity> entities(n);
+	for (auto &e : entities) {
+		e = {dist_p(mt), dist_p(mt), dist_v(mt), dist_v(mt)};
+	}
+	return entities;
+}
+
+int main(int argc, char **argv) {
+	int frames = argc > 1 ? std::atoi(argv[1]) : 20;
+	int max_threads = argc > 2 ? std::atoi(argv[2]) : 8;
+
+	printf("%-6s %7s %8s %9s %9s %9s %9s %10s %10s\n", "grid", "threads", "entities",
+			"add ms", "query ms", "clear ms", "total ms", "pairs", "candidates");
+
+	for (int n : {1000, 4000, 16000}) {
+		auto entities = spawn(n);
+
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			ThreadPool pool(threads);
+			pool.start();
+
+			// grids are large, keep them off the stack
+			auto *coarse = new GridC(SIZE);
+			report("coarse", threads, n, run<GridC, GridReferenceC>(*coarse, pool, entities, frames));
+			delete coarse;
+
+			auto *fine = new GridF(SIZE);
+			report("fine", threads, n, run<GridF, GridReferenceF>(*fine, pool, entities, frames));
+			delete fine;
+
+			auto *lockfree = new GridLF(SIZE);
+			report("lf", threads, n, run<GridLF, GridNode>(*lockfree, pool, entities, frames));
+			delete lockfree;
+
+			auto *hash = new GridHashLF(SIZE);
+			report("hash", threads, n, run<GridHashLF, GridHashRef>(*hash, pool, entities, frames));
+			delete hash;
+
+			pool.stop();
+		}
+	}
+
+	// sparse scenes, GridLF runs out of nodes beyond about 20000 entities
+	world = 1e6f;
+	for (int n : {16000, 250000, 1000000}) {
+		auto entities = spawn(n);
+
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			ThreadPool pool(threads);
+			pool.start();
+
+			if (n <= 16000) {
+				auto *lockfree = new GridLF(SIZE);
+				report("lf", threads, n, run<GridLF, GridNode>(*lockfree, pool, entities, frames));
+				delete lockfree;
+			}
+
+			auto *hash = new GridHashLF(SIZE);
+			report("hash", threads, n, run<GridHashLF, GridHashRef>(*hash, pool, entities, frames));
+			delete hash;
+
+			pool.stop();
+		}
+	}
+	return 0;
+}
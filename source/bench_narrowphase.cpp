@@ -0,0 +1,286 @@
+/*
+ * Benchmark of the circle narrowphase
+ *
+ * Candidate pairs come from the swept AABBs of moving circles in a hashed
+ * grid. "callback" tests one pair at a time through a std::function, as
+ * collisionCallback does in demo_glf, "batched" runs contact_times over the
+ * whole buffer and "pool" splits the buffer over the thread pool. contacts
+ * is the number of pairs which touch, mismatches the number of pairs where
+ * the batched result differs from the callback.
+ *
+ * The response rows resolve the touching pairs. "sequence" runs them in
+ * order on one thread, "colored" runs batches of pairs sharing no entity on
+ * the pool. colors is the number of batches, checksum must be the same for
+ * every thread count.
+ *
+ * Build with -mavx or -msse2 to select the vector width of contact_times.
+ *
+ * usage: bench_narrowphase [repeats] [max threads]
+ */
+
+#include <random>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <functional>
+#include <algorithm>
+
+#include "entity_soa.h"
+#include "narrowphase.h"
+#include "grid_hash.h"
+#include "threadpool.h"
+
+const float RADIUS = 5.0f;
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+struct vec {
+	float x, y;
+};
+
+vec operator-(vec a, vec b) {
+	return {a.x - b.x, a.y - b.y};
+}
+
+/*
+ * continuous test of demo_glf, every helper normalises the velocity again
+ */
+float perp(vec a, vec b) {
+	return (a.x * -b.y + a.y * b.x) / std::sqrt(b.x * b.x + b.y * b.y);
+}
+
+float proj(vec a, vec b) {
+	return (a.x * b.x + a.y * b.y) / std::sqrt(b.x * b.x + b.y * b.y);
+}
+
+float rd(float r, float c) {
+	return std::sqrt(r * r - c * c);
+}
+
+float ccd_time(vec a0, vec a1, vec b0, vec b1, float dt) {
+	auto d = a0 - b0;
+	auto v = (a1 - a0) - (b1 - b0);
+	if (d.x * d.x + d.y * d.y < 4.0f * RADIUS * RADIUS) return dt;
+
+	auto speed = std::sqrt(v.x * v.x + v.y * v.y);
+	if (speed == 0.f) return dt;
+
+	auto closest = std::fabs(perp(d, v));
+	if (closest > RADIUS * 2) return dt;
+
+	auto t = -proj(d, v);
+	auto t1 = (t - rd(RADIUS * 2, closest)) / speed * dt;
+	if (t1 < 0.f || t1 >= dt) return dt;
+	return t1;
+}
+
+/*
+ * end positions and velocities, restored before every response
+ */
+struct state {
+	std::vector<float> x1, y1, vx, vy;
+
+	void save(EntitySoA &body) {
+		int n = body.size();
+		x1.assign(body.x1, body.x1 + n);
+		y1.assign(body.y1, body.y1 + n);
+		vx.assign(body.vx, body.vx + n);
+		vy.assign(body.vy, body.vy + n);
+	}
+
+	void restore(EntitySoA &body) {
+		std::copy(x1.begin(), x1.end(), body.x1);
+		std::copy(y1.begin(), y1.end(), body.y1);
+		std::copy(vx.begin(), vx.end(), body.vx);
+		std::copy(vy.begin(), vy.end(), body.vy);
+	}
+};
+
+double checksum(EntitySoA &body) {
+	double sum = 0.0;
+	for (int i = 0; i < body.size(); i++) sum += body.x1[i] + body.y1[i] + body.vx[i] + body.vy[i];
+	return sum;
+}
+
+/*
+ * entities in a square world, about density circles per 100 x 100 area,
+ * moving up to speed per step
+ */
+void spawn(EntitySoA &body, int n, float density, float speed) {
+	float world = std::sqrt(n / density) * 100.0f;
+	std::mt19937 mt(0);
+	std::uniform_real_distribution<float> dist_p(0.0f, world);
+	std::uniform_real_distribution<float> dist_v(-speed, speed);
+
+	body.resize(n);
+	for (int i = 0; i < n; i++) {
+		body.x0[i] = dist_p(mt);
+		body.y0[i] = dist_p(mt);
+		body.x1[i] = body.x0[i] + dist_v(mt);
+		body.y1[i] = body.y0[i] + dist_v(mt);
+	}
+}
+
+/*
+ * candidate pairs of the swept AABBs
+ */
+void candidates(EntitySoA &body, std::vector<int> &a, std::vector<int> &b) {
+	int n = body.size();
+	GridHashLF grid(4 * RADIUS);
+	std::vector<GridHashRef*> refs(n);
+
+	for (int i = 0; i < n; i++) {
+		auto x1 = std::min(body.x0[i], body.x1[i]) - RADIUS;
+		auto y1 = std::min(body.y0[i], body.y1[i]) - RADIUS;
+		auto x2 = std::max(body.x0[i], body.x1[i]) + RADIUS;
+		auto y2 = std::max(body.y0[i], body.y1[i]) + RADIUS;
+		refs[i] = grid.add(i, x1, y1, x2, y2);
+	}
+
+	std::function<void(int,int)> func = [&](int i, int j) {
+		a.push_back(i);
+		b.push_back(j);
+	};
+	for (int i = 0; i < n; i++) {
+		grid.query_callback(refs[i], func);
+	}
+}
+
+int main(int argc, char **argv) {
+	int repeats = argc > 1 ? std::atoi(argv[1]) : 10;
+	int max_threads = argc > 2 ? std::atoi(argv[2]) : 8;
+
+	printf("%-8s %7s %8s %9s %10s %9s %10s %10s\n", "path", "threads", "speed",
+			"pairs", "contacts", "ms", "Mpairs/s", "mismatches");
+
+	for (float speed : {1.0f, 5.0f, 20.0f}) {
+		EntitySoA body;
+		spawn(body, 200000, 8.0f, speed);
+
+		std::vector<int> a, b;
+		candidates(body, a, b);
+		int n = a.size();
+
+		// one pair at a time through a callback
+		std::vector<float> expected(n);
+		int k = 0;
+		std::function<void(int,int)> func = [&](int i, int j) {
+			vec a0 = {body.x0[i], body.y0[i]};
+			vec a1 = {body.x1[i], body.y1[i]};
+			vec b0 = {body.x0[j], body.y0[j]};
+			vec b1 = {body.x1[j], body.y1[j]};
+			auto e = a1 - b1;
+			bool overlap = e.x * e.x + e.y * e.y < 4.0f * RADIUS * RADIUS;
+			float t = ccd_time(a0, a1, b0, b1, 1.f);
+			expected[k++] = (overlap || t < 1.f) ? t : -1.f;
+		};
+
+		auto start = Clock::now();
+		for (int r = 0; r < repeats; r++) {
+			k = 0;
+			for (int p = 0; p < n; p++) func(a[p], b[p]);
+		}
+		double ms = elapsed(start) / repeats;
+		long contacts = std::count_if(expected.begin(), expected.end(), [](float t) { return t >= 0.f; });
+		printf("%-8s %7d %8.1f %9d %10ld %9.3f %10.2f %10d\n", "callback", 1, speed,
+				n, contacts, ms, n / ms / 1e3, 0);
+
+		// whole buffer at once
+		std::vector<float> t(n);
+		start = Clock::now();
+		for (int r = 0; r < repeats; r++) contact_times(body, RADIUS, a.data(), b.data(), n, t.data());
+		ms = elapsed(start) / repeats;
+
+		long mismatches = 0;
+		for (int p = 0; p < n; p++) {
+			if ((t[p] >= 0.f) != (expected[p] >= 0.f) || std::fabs(t[p] - expected[p]) > 1e-3f) mismatches++;
+		}
+		contacts = std::count_if(t.begin(), t.end(), [](float t) { return t >= 0.f; });
+		printf("%-8s %7d %8.1f %9d %10ld %9.3f %10.2f %10ld\n", "batched", 1, speed,
+				n, contacts, ms, n / ms / 1e3, mismatches);
+
+		// buffer split over the pool
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			ThreadPool pool(threads);
+			pool.start();
+
+			PairBuffer pairs;
+			for (int p = 0; p < n; p++) pairs.push(a[p], b[p]);
+
+			start = Clock::now();
+			for (int r = 0; r < repeats; r++) pairs.narrowphase(pool, body, RADIUS);
+			ms = elapsed(start) / repeats;
+
+			contacts = 0;
+			pairs.contacts([&](int, int, float) { contacts++; });
+			printf("%-8s %7d %8.1f %9d %10ld %9.3f %10.2f %10s\n", "pool", threads, speed,
+					n, contacts, ms, n / ms / 1e3, "-");
+
+			pool.stop();
+		}
+	}
+
+	printf("\n%-8s %7s %8s %9s %7s %9s %10s %14s\n", "response", "threads", "density",
+			"contacts", "colors", "ms", "Mpairs/s", "checksum");
+
+	for (float density : {8.0f, 32.0f}) {
+		EntitySoA body;
+		spawn(body, 200000, density, 5.0f);
+
+		std::vector<int> a, b;
+		candidates(body, a, b);
+
+		state saved;
+		saved.save(body);
+
+		PairBuffer pairs;
+		for (int p = 0; p < (int) a.size(); p++) pairs.push(a[p], b[p]);
+
+		std::function<void(int,int,float)> func = std::bind(reflect_contact, std::ref(body),
+				std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			ThreadPool pool(threads);
+			pool.start();
+			saved.restore(body);
+			pairs.narrowphase(pool, body, RADIUS);
+
+			long contacts = 0;
+			pairs.contacts([&](int, int, float) { contacts++; });
+
+			// pairs in order, one thread
+			if (threads == 1) {
+				double ms = 0.0;
+				for (int r = 0; r < repeats; r++) {
+					saved.restore(body);
+					auto start = Clock::now();
+					pairs.contacts(func);
+					ms += elapsed(start);
+				}
+				ms /= repeats;
+				printf("%-8s %7d %8.1f %9ld %7d %9.3f %10.2f %14.3f\n", "sequence", 1, density,
+						contacts, 1, ms, contacts / ms / 1e3, checksum(body));
+			}
+
+			double ms = 0.0;
+			for (int r = 0; r < repeats; r++) {
+				saved.restore(body);
+				auto start = Clock::now();
+				pairs.resolve(pool, body.size(), func);
+				ms += elapsed(start);
+			}
+			ms /= repeats;
+			printf("%-8s %7d %8.1f %9ld %7d %9.3f %10.2f %14.3f\n", "colored", threads, density,
+					contacts, pairs.colors(), ms, contacts / ms / 1e3, checksum(body));
+
+			pool.stop();
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,479 @@
+/*
+ * Microbenchmark of the primitive operations of every broadphase
+ *
+ * Each operation runs on its own, for every entity of a freshly built
+ * structure, with the entities split evenly over the threads of the pool so
+ * all threads contend for the same structure. Every operation is timed on
+ * its own, Mops/s is the number of operations over the wall time of the
+ * whole run and the percentiles are latencies in ns. clear runs once per
+ * repeat, its percentiles are taken over the repeats.
+ *
+ * update moves every entity by up to disp in x and y, further moves walk
+ * further along the SAP lists and change grid cells more often. The
+ * lock-free grid is created persistent for update, which is move, and
+ * remove, and rebuilt every frame for the other operations.
+ *
+ * Not every structure has every operation, the coarse grid cannot remove
+ * or move entities and only the lock-free SAP list has update2. The
+ * lock-free SAP list only runs on one thread, see demo_slf.
+ *
+ * With perf as the last argument, cycles, instructions, cache misses and
+ * branch misses per operation are counted with perf_event_open where the
+ * system allows it, - marks events which are not. Counts include the timing
+ * of every operation.
+ *
+ * usage: bench_ops [repeats] [max threads] [max entities] [perf]
+ */
+
+#include <random>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <functional>
+#include <algorithm>
+
+#include "grid_coarse.h"
+#include "grid_lockfree.h"
+#include "sap_coarse.h"
+#include "sap_optimistic.h"
+#include "sap_lockfree.h"
+#include "perf_counters.h"
+#include "threadpool.h"
+
+// size of the entities
+const float SIZE = 10.0f;
+
+struct box {
+	float x1, y1, x2, y2;
+};
+
+struct result {
+	double mops;
+	float p50, p90, p99, max;
+
+	// hardware events per operation
+	double events[PerfCounters::EVENTS];
+};
+
+// counts the events of pool tasks, null if not counted
+PerfCounters *perf = nullptr;
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/*
+ * sweep and prune lists along x, nodes are returned on destruction
+ */
+template<class List, class Ref>
+class SapBench {
+	List *list;
+	std::vector<Ref> refs;
+	std::vector<char> live;
+
+	public:
+
+	static const bool REMOVE = true;
+	static const bool UPDATE = true;
+	static const bool UPDATE2 = false;
+	static const bool CLEAR = false;
+
+	SapBench(int n, bool) : refs(n), live(n, 0) {
+		list = new List();
+	};
+
+	~SapBench() {
+		for (int i = 0; i < (int) refs.size(); i++) {
+			if (live[i]) list->remove(refs[i]);
+		}
+		delete list;
+	};
+
+	void add(int i, const box &b) {
+		refs[i] = list->add(i, b.x1, b.x2 - b.x1);
+		live[i] = 1;
+	};
+
+	void remove(int i) {
+		list->remove(refs[i]);
+		live[i] = 0;
+	};
+
+	void update(int i, const box &b) {
+		refs[i] = list->update(refs[i], b.x1, b.x2 - b.x1);
+	};
+
+	void update2(int, const box &) {
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		list->query_callback(refs[i], func);
+	};
+
+	void clear(ThreadPool &) {
+	};
+};
+
+/*
+ * the lock-free list keeps its nodes in a pool and has update2
+ */
+class SapBenchLF {
+	SapListLF *list;
+	std::vector<uint32_t> refs;
+
+	public:
+
+	static const bool REMOVE = true;
+	static const bool UPDATE = true;
+	static const bool UPDATE2 = true;
+	static const bool CLEAR = false;
+
+	SapBenchLF(int n, bool) : refs(n) {
+		list = new SapListLF();
+	};
+
+	~SapBenchLF() {
+		delete list;
+	};
+
+	void add(int i, const box &b) {
+		refs[i] = list->add(i, b.x1, b.x2 - b.x1);
+	};
+
+	void remove(int i) {
+		list->remove(refs[i]);
+	};
+
+	void update(int i, const box &b) {
+		refs[i] = list->update(refs[i], b.x1, b.x2 - b.x1);
+	};
+
+	void update2(int i, const box &b) {
+		refs[i] = list->update2(refs[i], b.x1, b.x2 - b.x1);
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		list->query_callback(refs[i], func);
+	};
+
+	void clear(ThreadPool &) {
+	};
+};
+
+class GridBenchC {
+	GridC *grid;
+	std::vector<GridReferenceC*> refs;
+
+	public:
+
+	static const bool REMOVE = false;
+	static const bool UPDATE = false;
+	static const bool UPDATE2 = false;
+	static const bool CLEAR = true;
+
+	GridBenchC(int n, bool) : refs(n, nullptr) {
+		grid = new GridC(SIZE);
+	};
+
+	~GridBenchC() {
+		clear_refs();
+		grid->clear();
+		delete grid;
+	};
+
+	void clear_refs(void) {
+		for (auto *&ref : refs) {
+			grid->returnRefNodes(ref);
+			ref = nullptr;
+		}
+	};
+
+	void add(int i, const box &b) {
+		refs[i] = grid->add(i, b.x1, b.y1, b.x2, b.y2);
+	};
+
+	void remove(int) {
+	};
+
+	void update(int, const box &) {
+	};
+
+	void update2(int, const box &) {
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		grid->query_callback(refs[i], i, func);
+	};
+
+	void clear(ThreadPool &) {
+		clear_refs();
+		grid->clear();
+	};
+};
+
+class GridBenchLF {
+	GridLF *grid;
+	std::vector<GridNode*> refs;
+
+	public:
+
+	static const bool REMOVE = true;
+	static const bool UPDATE = true;
+	static const bool UPDATE2 = false;
+	static const bool CLEAR = true;
+
+	GridBenchLF(int n, bool persistent) : refs(n, nullptr) {
+		grid = new GridLF(SIZE, persistent);
+	};
+
+	~GridBenchLF() {
+		delete grid;
+	};
+
+	void add(int i, const box &b) {
+		refs[i] = grid->add(i, b.x1, b.y1, b.x2, b.y2);
+	};
+
+	void remove(int i) {
+		grid->remove(refs[i]);
+	};
+
+	void update(int i, const box &b) {
+		grid->move(refs[i], b.x1, b.y1, b.x2, b.y2);
+	};
+
+	void update2(int, const box &) {
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		grid->query_callback(refs[i], func);
+	};
+
+	void clear(ThreadPool &pool) {
+		grid->clear(pool);
+		pool.wait();
+	};
+};
+
+/*
+ * latency percentiles of the samples, which are sorted in place
+ */
+result summarize(std::vector<float> &samples, long ops, double ms, const PerfCounters::Values &events) {
+	std::sort(samples.begin(), samples.end());
+	auto at = [&](double q) {
+		return samples[std::min((size_t) (q * samples.size()), samples.size() - 1)];
+	};
+	result r = {ops / ms / 1e3, at(0.5), at(0.9), at(0.99), samples.back(), {}};
+	for (int e = 0; e < PerfCounters::EVENTS; e++) r.events[e] = (double) events[e] / ops;
+	return r;
+}
+
+/*
+ * Run op on every entity of a structure built by setup, threads tasks of
+ * consecutive entities. setup is not timed.
+ */
+template<class Bench, class Setup, class Op>
+result measure(ThreadPool &pool, int threads, int n, int repeats, bool persistent, Setup setup, Op op) {
+	std::vector<float> samples;
+	std::vector<float> latency(n);
+	double ms = 0.0;
+	PerfCounters::Values events = {};
+
+	for (int r = 0; r < repeats; r++) {
+		auto *bench = new Bench(n, persistent);
+		setup(*bench);
+
+		// drop the events of setup
+		PerfCounters::Values dropped = {};
+		if (perf) perf->collect(dropped);
+
+		auto start = Clock::now();
+		for (int t = 0; t < threads; t++) {
+			int begin = (long) n * t / threads;
+			int end = (long) n * (t + 1) / threads;
+			pool.add([&, begin, end] {
+				for (int i = begin; i < end; i++) {
+					auto s = Clock::now();
+					op(*bench, i);
+					latency[i] = std::chrono::duration<float, std::nano>(Clock::now() - s).count();
+				}
+			});
+		}
+		pool.wait();
+		ms += elapsed(start);
+		if (perf) perf->collect(events);
+
+		samples.insert(samples.end(), latency.begin(), latency.end());
+		delete bench;
+	}
+	return summarize(samples, (long) n * repeats, ms, events);
+}
+
+/*
+ * clear of a structure holding every entity, once per repeat
+ */
+template<class Bench, class Setup>
+result measure_clear(ThreadPool &pool, int n, int repeats, Setup setup) {
+	std::vector<float> samples;
+	double ms = 0.0;
+	PerfCounters::Values events = {};
+
+	for (int r = 0; r < repeats; r++) {
+		auto *bench = new Bench(n, false);
+		setup(*bench);
+
+		PerfCounters::Values dropped = {};
+		if (perf) perf->collect(dropped);
+
+		// clear runs on this thread, or on the pool
+		auto start = Clock::now();
+		if (perf) perf->start();
+		bench->clear(pool);
+		if (perf) perf->stop();
+		samples.push_back(elapsed(start) * 1e6);
+		ms += elapsed(start);
+		if (perf) perf->collect(events);
+
+		delete bench;
+	}
+	return summarize(samples, repeats, ms, events);
+}
+
+void report(const char *name, const char *op, int threads, int n, const char *disp, result r) {
+	printf("%-8s %-8s %7d %8d %6s %9.3f %9.0f %9.0f %9.0f %10.0f", name, op, threads, n, disp,
+			r.mops, r.p50, r.p90, r.p99, r.max);
+	if (perf) {
+		for (int e = 0; e < PerfCounters::EVENTS; e++) {
+			if (perf->supports((PerfCounters::Event) e)) printf(" %10.1f", r.events[e]);
+			else printf(" %10s", "-");
+		}
+	}
+	printf("\n");
+}
+
+/*
+ * entities spread over a square world, 0 seeded. Boxes are added in
+ * descending x so setup does not walk the SAP lists.
+ */
+std::vector<box> spawn(int n, float world, std::vector<int> &order) {
+	std::mt19937 mt(0);
+	std::uniform_real_distribution<float> dist_p(0.0f, world - SIZE);
+
+	std::vector<box> boxes(n);
+	for (auto &b : boxes) {
+		float x = dist_p(mt);
+		float y = dist_p(mt);
+		b = {x, y, x + SIZE, y + SIZE};
+	}
+
+	order.resize(n);
+	for (int i = 0; i < n; i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return boxes[a].x1 > boxes[b].x1; });
+	return boxes;
+}
+
+/*
+ * boxes moved by up to disp in x and y, kept inside the world
+ */
+std::vector<box> displace(const std::vector<box> &boxes, float world, float disp) {
+	std::mt19937 mt(1);
+	std::uniform_real_distribution<float> dist_d(-disp, disp);
+
+	std::vector<box> moved(boxes.size());
+	for (int i = 0; i < (int) boxes.size(); i++) {
+		float x = std::min(std::max(boxes[i].x1 + dist_d(mt), 0.0f), world - SIZE);
+		float y = std::min(std::max(boxes[i].y1 + dist_d(mt), 0.0f), world - SIZE);
+		moved[i] = {x, y, x + SIZE, y + SIZE};
+	}
+	return moved;
+}
+
+template<class Bench>
+void run(const char *name, ThreadPool &pool, int threads, int repeats, float world, const std::vector<box> &boxes, const std::vector<int> &order) {
+	int n = boxes.size();
+
+	auto empty = [](Bench &) {};
+	auto filled = [&](Bench &b) {
+		for (int i : order) b.add(i, boxes[i]);
+	};
+
+	report(name, "add", threads, n, "-", measure<Bench>(pool, threads, n, repeats, false, empty,
+			[&](Bench &b, int i) { b.add(i, boxes[i]); }));
+
+	std::function<void(int,int)> func = [](int, int) {};
+	report(name, "query", threads, n, "-", measure<Bench>(pool, threads, n, repeats, false, filled,
+			[&](Bench &b, int i) { b.query(i, func); }));
+
+	if (Bench::REMOVE) {
+		report(name, "remove", threads, n, "-", measure<Bench>(pool, threads, n, repeats, true, filled,
+				[&](Bench &b, int i) { b.remove(i); }));
+	}
+
+	for (float disp : {1.0f, 10.0f, 100.0f}) {
+		auto moved = displace(boxes, world, disp);
+		char label[16];
+		snprintf(label, sizeof(label), "%g", disp);
+
+		if (Bench::UPDATE) {
+			report(name, "update", threads, n, label, measure<Bench>(pool, threads, n, repeats, true, filled,
+					[&](Bench &b, int i) { b.update(i, moved[i]); }));
+		}
+		if (Bench::UPDATE2) {
+			report(name, "update2", threads, n, label, measure<Bench>(pool, threads, n, repeats, true, filled,
+					[&](Bench &b, int i) { b.update2(i, moved[i]); }));
+		}
+	}
+
+	if (Bench::CLEAR) {
+		report(name, "clear", threads, n, "-", measure_clear<Bench>(pool, n, repeats, filled));
+	}
+}
+
+int main(int argc, char **argv) {
+	int repeats = argc > 1 ? std::atoi(argv[1]) : 5;
+	int max_threads = argc > 2 ? std::atoi(argv[2]) : 8;
+	int max_entities = argc > 3 ? std::atoi(argv[3]) : 10000;
+
+	PerfCounters counters;
+	if (argc > 4 && !strcmp(argv[4], "perf")) {
+		if (counters.available()) perf = &counters;
+		else fprintf(stderr, "hardware counters unavailable: %s\n", counters.error().c_str());
+	}
+
+	printf("%-8s %-8s %7s %8s %6s %9s %9s %9s %9s %10s", "struct", "op", "threads", "entities",
+			"disp", "Mops/s", "p50 ns", "p90 ns", "p99 ns", "max ns");
+	if (perf) printf(" %10s %10s %10s %10s", "cycles", "instr", "llc miss", "br miss");
+	printf("\n");
+
+	for (int n : {1000, 10000, 20000}) {
+		if (n > max_entities) break;
+
+		// density of bench_grid, 1000 entities in 1000 x 1000
+		float world = 1000.0f * std::sqrt(n / 1000.0f);
+		std::vector<int> order;
+		auto boxes = spawn(n, world, order);
+
+		for (int threads = 1; threads <= max_threads; threads *= 2) {
+			ThreadPool pool(threads);
+			pool.observe(perf);
+			pool.start();
+
+			run<SapBench<SapListC, SapNodeC*>>("sap_c", pool, threads, repeats, world, boxes, order);
+			run<SapBench<SapListO, SapNodeO*>>("sap_o", pool, threads, repeats, world, boxes, order);
+			if (threads == 1) run<SapBenchLF>("sap_lf", pool, threads, repeats, world, boxes, order);
+			run<GridBenchC>("grid_c", pool, threads, repeats, world, boxes, order);
+			// GridLF takes 9 of its 204800 nodes per entity and 4 more for
+			// every move, which only purge frees once the moves are done.
+			// A pass of moves runs out of nodes beyond about 15000 entities.
+			if (n * 13 <= 204800) run<GridBenchLF>("grid_lf", pool, threads, repeats, world, boxes, order);
+
+			pool.stop();
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,682 @@
+/*
+ * Headless benchmark of a whole physics step
+ *
+ * Runs the step of demo_glf without a window: SoA kinematics and walls,
+ * broadphase update and query, batched narrowphase and coloured response.
+ * The broadphase is chosen on the command line. Prints one row per frame
+ * with the time of every phase, the number of candidate pairs reported by
+ * the broadphase and the number of contacts resolved.
+ *
+ * The box grows with the number of entities to keep the density of the
+ * demos, 500 circles in 800 x 600.
+ *
+ * The mixed scene makes one entity in 1000 a hundred times wider than the
+ * others, with --radius 2.5 that is 5 unit debris among 500 unit vehicles.
+ * The box grows to hold two large entities side by side. Walls keep every
+ * entity inside by its own size, but narrowphase and response treat every
+ * entity as a circle of --radius, so the large entities only change what
+ * the broadphase sees.
+ *
+ * The clustered scene puts the entities into 8 dense clusters in a box 4
+ * times wider and higher, most of which stays empty. Entities keep their
+ * speeds, so the clusters drift and spread out over long runs.
+ *
+ * usage: bench_world [options]
+ *   --broadphase NAME  brute, grid_coarse, grid_fine, grid_csr, grid_lockfree,
+ *                      grid_hierarchical, grid_hash, quadtree, aabbtree, lbvh,
+ *                      sap_coarse, sap_optimistic or sap_lockfree
+ *                      (grid_lockfree)
+ *   --scene NAME       uniform, mixed or clustered (uniform)
+ *   --entities N       number of circles (500)
+ *   --threads N        worker threads (1)
+ *   --steps N          frames to run (300)
+ *   --seed N           seed of the initial positions and velocities (0)
+ *   --dt T             length of a step (1)
+ *   --radius R         radius of the circles (5)
+ *   --format F         csv or json (csv)
+ *
+ * grid_lockfree and sap_lockfree have fixed node pools, and sap_lockfree
+ * is known to break with more than one thread, see demo_slf.
+ *
+ * grid_csr and lbvh are rebuilt from the inserted boxes every frame, the
+ * build is timed as part of the update.
+ */
+
+#include <atomic>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <functional>
+#include <algorithm>
+
+#include "entity_soa.h"
+#include "narrowphase.h"
+#include "grid_coarse.h"
+#include "grid_fine.h"
+#include "grid_csr.h"
+#include "grid_lockfree.h"
+#include "grid_hierarchical.h"
+#include "grid_hash.h"
+#include "quadtree_lockfree.h"
+#include "aabbtree.h"
+#include "lbvh.h"
+#include "sap_coarse.h"
+#include "sap_optimistic.h"
+#include "sap_lockfree.h"
+#include "threadpool.h"
+
+// entities per task
+const int CHUNK = 64;
+
+// one entity in LARGE_EVERY of the mixed scene is LARGE_SCALE times wider
+const int LARGE_EVERY = 1000;
+const float LARGE_SCALE = 100.0f;
+
+// clusters of the clustered scene
+const int CLUSTERS = 8;
+
+struct options {
+	std::string broadphase = "grid_lockfree";
+	std::string scene = "uniform";
+	int entities = 500;
+	int threads = 1;
+	int steps = 300;
+	int seed = 0;
+	float dt = 1.0f;
+	float radius = 5.0f;
+	std::string format = "csv";
+};
+
+/*
+ * time of every phase of one frame in ms
+ */
+struct frame {
+	double kinematics;
+	double update;
+	double query;
+	double narrowphase;
+	double response;
+	double clear;
+	long candidates;
+	long contacts;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsed(Clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/*
+ * half the width of the AABB of entity i, without its sweep
+ */
+float extent(const options &opt, int i) {
+	if (opt.scene == "mixed" && i % LARGE_EVERY == 0) return LARGE_SCALE * opt.radius;
+	return opt.radius;
+}
+
+/*
+ * rough number of nodes a lock-free grid with cells of 2 radii needs. An
+ * entity of the radius takes about 12, a larger one 2 for every cell it
+ * covers. levels puts large entities on a coarse level of their own.
+ */
+long grid_nodes(const options &opt, bool levels) {
+	long nodes = 0;
+	for (int i = 0; i < opt.entities; i++) {
+		auto e = extent(opt, i);
+		if (e == opt.radius) {
+			nodes += 12;
+		} else if (!levels) {
+			long cells = (long) (e / opt.radius) + 2;
+			nodes += 2 * cells * cells;
+		}
+	}
+	return nodes;
+}
+
+/*
+ * every pair of swept AABBs is tested
+ */
+class BruteForce {
+	std::vector<float> x1, y1, x2, y2;
+
+	public:
+
+	BruteForce(int n, float, float, float) : x1(n), y1(n), x2(n), y2(n) {
+	};
+
+	void insert(int i, float a, float b, float c, float d) {
+		x1[i] = a;
+		y1[i] = b;
+		x2[i] = c;
+		y2[i] = d;
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		for (int j = i + 1; j < (int) x1.size(); j++) {
+			if (x1[j] > x2[i] || x2[j] < x1[i]) continue;
+			if (y1[j] > y2[i] || y2[j] < y1[i]) continue;
+			func(i, j);
+		}
+	};
+
+	void clear(void) {
+	};
+};
+
+/*
+ * the coarse grid is told the eid, the other grids store it in their
+ * references
+ */
+void query(GridC &grid, GridReferenceC *ref, int eid, std::function<void(int,int)> &func) {
+	grid.query_callback(ref, eid, func);
+}
+
+template<class Grid, class Ref>
+void query(Grid &grid, Ref &ref, int, std::function<void(int,int)> &func) {
+	grid.query_callback(ref, func);
+}
+
+/*
+ * grid rebuilt every frame
+ */
+template<class Grid, class Ref>
+class GridPhase {
+	Grid *grid;
+	std::vector<Ref> refs;
+
+	public:
+
+	GridPhase(int n, float cell, float, float) : refs(n) {
+		// grids are large, keep them off the stack
+		grid = new Grid(cell);
+	};
+
+	~GridPhase() {
+		delete grid;
+	};
+
+	void insert(int i, float x1, float y1, float x2, float y2) {
+		refs[i] = grid->add(i, x1, y1, x2, y2);
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		::query(*grid, refs[i], i, func);
+	};
+
+	void clear(void) {
+		for (auto &ref : refs) grid->returnRefNodes(ref);
+		grid->clear();
+	};
+};
+
+/*
+ * flat grid rebuilt from the swept boxes every frame
+ */
+class FlatPhase {
+	GridCSR *grid;
+	std::vector<int> refs;
+
+	public:
+
+	FlatPhase(int n, float cell, float, float) : refs(n) {
+		grid = new GridCSR(cell, n);
+	};
+
+	~FlatPhase() {
+		delete grid;
+	};
+
+	void insert(int i, float x1, float y1, float x2, float y2) {
+		refs[i] = grid->add(i, x1, y1, x2, y2);
+	};
+
+	void build(ThreadPool &pool) {
+		grid->build(pool, CHUNK);
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		grid->query_callback(refs[i], func);
+	};
+
+	void clear(void) {
+		grid->clear();
+	};
+};
+
+/*
+ * sweep and prune list along x, kept between frames
+ */
+template<class List, class Ref>
+class SapPhase {
+	List *list;
+	std::vector<Ref> refs;
+	std::vector<char> added;
+
+	public:
+
+	SapPhase(int n, float, float, float) : refs(n), added(n, 0) {
+		list = new List();
+	};
+
+	~SapPhase() {
+		delete list;
+	};
+
+	void insert(int i, float x1, float, float x2, float) {
+		if (added[i]) {
+			refs[i] = list->update(refs[i], x1, x2 - x1);
+		} else {
+			refs[i] = list->add(i, x1, x2 - x1);
+			added[i] = 1;
+		}
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		list->query_callback(refs[i], func);
+	};
+
+	void clear(void) {
+	};
+};
+
+/*
+ * loose quadtree over the box, kept between frames. Its deepest nodes are
+ * about twice as large as an entity.
+ */
+class QuadPhase {
+	QuadTreeLF *tree;
+	std::vector<uint32_t> refs;
+
+	public:
+
+	QuadPhase(int n, float cell, float width, float height) : refs(n, 0) {
+		float side = std::max(width, height);
+
+		// node arrays grow by 4 per level, 10 levels hold 350k nodes
+		int depth = 1;
+		while (depth < 10 && side / (1 << (depth - 1)) > 2.0f * cell) depth++;
+		tree = new QuadTreeLF(0.0f, 0.0f, side, depth, n);
+	};
+
+	~QuadPhase() {
+		delete tree;
+	};
+
+	void insert(int i, float x1, float y1, float x2, float y2) {
+		if (refs[i]) tree->update(refs[i], x1, y1, x2, y2);
+		else refs[i] = tree->insert(i, x1, y1, x2, y2);
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		tree->query_callback(refs[i], func);
+	};
+
+	/*
+	 * links left behind by moves are only returned by purge
+	 */
+	void clear(void) {
+		tree->purge();
+	};
+};
+
+/*
+ * dynamic AABB tree kept between frames, leaves are fattened by a radius
+ * so most entities are not reinserted every frame
+ */
+class TreePhase {
+	AABBTree *tree;
+	std::vector<int> refs;
+
+	public:
+
+	TreePhase(int n, float cell, float, float) : refs(n, -1) {
+		tree = new AABBTree(0.5f * cell, n);
+	};
+
+	~TreePhase() {
+		delete tree;
+	};
+
+	void insert(int i, float x1, float y1, float x2, float y2) {
+		if (refs[i] >= 0) tree->update(refs[i], x1, y1, x2, y2);
+		else refs[i] = tree->add(i, x1, y1, x2, y2);
+	};
+
+	void query(int i, std::function<void(int,int)> &func) {
+		tree->query_callback(refs[i], func);
+	};
+
+	void query_all(ThreadPool &pool, std::function<void(int,int)> &func) {
+		tree->query_all(pool, func);
+	};
+
+	void clear(void) {
+	};
+};
+
+/*
+ * linear BVH rebuilt from the swept boxes every frame
+ */
+class LBVHPhase {
+	LBVH *tree;
+
+	public:
+
+	LBVHPhase(int n, float, float, float) {
+		tree = new LBVH(n);
+	};
+
+	~LBVHPhase() {
+		delete tree;
+	};
+
+	void insert(int i, float x1, float y1, float x2, float y2) {
+		tree->add(i, x1, y1, x2, y2);
+	};
+
+	void build(ThreadPool &pool) {
+		tree->build(pool);
+	};
+
+	/*
+	 * every pair is found at once, then the buffer of every chunk of leaves
+	 * is handed to func in its own task
+	 */
+	void query_all(ThreadPool &pool, std::function<void(int,int)> &func) {
+		tree->find_pairs(pool);
+		for (int c = 0; c < tree->num_chunks(); c++) {
+			pool.add([this, c, &func] {
+				for (auto &p : tree->pairs(c)) func(p.first, p.second);
+			});
+		}
+		pool.wait();
+	};
+
+	void clear(void) {
+		tree->clear();
+	};
+};
+
+/*
+ * structures built from all inserted boxes at once do it after the inserts
+ */
+template<class Phase>
+void build(Phase &, ThreadPool &) {
+}
+
+void build(FlatPhase &phase, ThreadPool &pool) {
+	phase.build(pool);
+}
+
+void build(LBVHPhase &phase, ThreadPool &pool) {
+	phase.build(pool);
+}
+
+/*
+ * report the pairs of every entity, CHUNK entities per task
+ */
+template<class Phase>
+void query_pairs(Phase &phase, ThreadPool &pool, int n, std::function<void(int,int)> &func) {
+	for (int begin = 0; begin < n; begin += CHUNK) {
+		pool.add([&, begin] {
+			for (int i = begin; i < std::min(begin + CHUNK, n); i++) {
+				phase.query(i, func);
+			}
+		});
+	}
+	pool.wait();
+}
+
+/*
+ * the tree finds all pairs at once with parallel subtree traversals
+ */
+void query_pairs(TreePhase &phase, ThreadPool &pool, int, std::function<void(int,int)> &func) {
+	phase.query_all(pool, func);
+}
+
+void query_pairs(LBVHPhase &phase, ThreadPool &pool, int, std::function<void(int,int)> &func) {
+	phase.query_all(pool, func);
+}
+
+template<class Phase>
+std::vector<frame> run(const options &opt) {
+	int n = opt.entities;
+	float r = opt.radius;
+	float dt = opt.dt;
+
+	// 4:3 box with the density of 500 circles in 800 x 600
+	float width = std::sqrt(800.0f * 600.0f * n / 500.0f * 4.0f / 3.0f);
+	float height = width * 0.75f;
+
+	// entities of the radius and larger ones, walls use their own extent
+	std::vector<float> extents(n);
+	std::vector<int> small, large;
+	for (int i = 0; i < n; i++) {
+		extents[i] = extent(opt, i);
+		(extents[i] == r ? small : large).push_back(i);
+	}
+
+	// room for two large entities side by side
+	if (!large.empty()) {
+		float scale = std::max(1.0f, 4.0f * LARGE_SCALE * r / height);
+		width *= scale;
+		height *= scale;
+	}
+
+	// clusters about as large as the box of the uniform scene together,
+	// in a box 16 times larger
+	bool clustered = opt.scene == "clustered";
+	float sigma = height / 8.0f;
+	if (clustered) {
+		width *= 4.0f;
+		height *= 4.0f;
+	}
+
+	std::mt19937 mt(opt.seed);
+	std::uniform_real_distribution<float> dist_v(1.0f, 5.0f);
+
+	std::vector<float> cx(CLUSTERS), cy(CLUSTERS);
+	for (int c = 0; clustered && c < CLUSTERS; c++) {
+		cx[c] = std::uniform_real_distribution<float>(2.0f * sigma, width - 2.0f * sigma)(mt);
+		cy[c] = std::uniform_real_distribution<float>(2.0f * sigma, height - 2.0f * sigma)(mt);
+	}
+
+	EntitySoA body(n);
+	for (int i = 0; i < n; i++) {
+		float e = extents[i];
+		if (clustered) {
+			int c = i % CLUSTERS;
+			body.x1[i] = std::clamp(std::normal_distribution<float>(cx[c], sigma)(mt), e, width - e);
+			body.y1[i] = std::clamp(std::normal_distribution<float>(cy[c], sigma)(mt), e, height - e);
+		} else {
+			body.x1[i] = std::uniform_real_distribution<float>(e, width - e)(mt);
+			body.y1[i] = std::uniform_real_distribution<float>(e, height - e)(mt);
+		}
+		body.vx[i] = dist_v(mt);
+		body.vy[i] = dist_v(mt);
+	}
+
+	ThreadPool pool(opt.threads);
+	pool.start();
+
+	Phase phase(n, 2.0f * r, width, height);
+	PairBuffer pairs;
+	std::atomic<long> contacts(0);
+
+	std::function<void(int,int)> push = std::bind(&PairBuffer::push, &pairs, std::placeholders::_1, std::placeholders::_2);
+	std::function<void(int,int,float)> respond = [&](int a, int b, float t) {
+		reflect_contact(body, a, b, t);
+		contacts.fetch_add(1, std::memory_order_relaxed);
+	};
+
+	std::vector<frame> frames;
+	for (int step = 0; step < opt.steps; step++) {
+		frame f;
+		contacts.store(0);
+
+		auto start = Clock::now();
+		if (large.empty()) {
+			body.kinematics(pool, dt, r, width, height);
+		} else {
+			body.kinematics(pool, dt, r, width, height, small);
+			body.kinematics(pool, dt, LARGE_SCALE * r, width, height, large);
+		}
+		f.kinematics = elapsed(start);
+
+		// swept AABBs
+		start = Clock::now();
+		for (int begin = 0; begin < n; begin += CHUNK) {
+			pool.add([&, begin] {
+				for (int i = begin; i < std::min(begin + CHUNK, n); i++) {
+					auto e = extents[i];
+					auto x1 = std::min(body.x0[i], body.x1[i]) - e;
+					auto y1 = std::min(body.y0[i], body.y1[i]) - e;
+					auto x2 = std::max(body.x0[i], body.x1[i]) + e;
+					auto y2 = std::max(body.y0[i], body.y1[i]) + e;
+					phase.insert(i, x1, y1, x2, y2);
+				}
+			});
+		}
+		pool.wait();
+		build(phase, pool);
+		f.update = elapsed(start);
+
+		start = Clock::now();
+		query_pairs(phase, pool, n, push);
+		f.query = elapsed(start);
+		f.candidates = pairs.size();
+
+		start = Clock::now();
+		pairs.narrowphase(pool, body, r);
+		f.narrowphase = elapsed(start);
+
+		start = Clock::now();
+		pairs.resolve(pool, n, respond);
+		f.response = elapsed(start);
+		f.contacts = contacts.load();
+
+		start = Clock::now();
+		phase.clear();
+		pairs.clear();
+		f.clear = elapsed(start);
+
+		frames.push_back(f);
+	}
+
+	pool.stop();
+	return frames;
+}
+
+double total(const frame &f) {
+	return f.kinematics + f.update + f.query + f.narrowphase + f.response + f.clear;
+}
+
+void print_csv(const options &opt, const std::vector<frame> &frames) {
+	printf("broadphase,scene,entities,threads,frame,kinematics_ms,update_ms,query_ms,"
+			"narrowphase_ms,response_ms,clear_ms,total_ms,candidates,contacts\n");
+	for (int i = 0; i < (int) frames.size(); i++) {
+		auto &f = frames[i];
+		printf("%s,%s,%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%ld,%ld\n",
+				opt.broadphase.c_str(), opt.scene.c_str(), opt.entities, opt.threads, i,
+				f.kinematics, f.update, f.query, f.narrowphase, f.response, f.clear,
+				total(f), f.candidates, f.contacts);
+	}
+}
+
+void print_json(const options &opt, const std::vector<frame> &frames) {
+	printf("{\"broadphase\": \"%s\", \"scene\": \"%s\", \"entities\": %d, \"threads\": %d, "
+			"\"steps\": %d, \"seed\": %d, \"dt\": %g, \"radius\": %g, \"frames\": [\n",
+			opt.broadphase.c_str(), opt.scene.c_str(), opt.entities, opt.threads, opt.steps,
+			opt.seed, opt.dt, opt.radius);
+	for (int i = 0; i < (int) frames.size(); i++) {
+		auto &f = frames[i];
+		printf("  {\"frame\": %d, \"kinematics_ms\": %.4f, \"update_ms\": %.4f, "
+				"\"query_ms\": %.4f, \"narrowphase_ms\": %.4f, \"response_ms\": %.4f, "
+				"\"clear_ms\": %.4f, \"total_ms\": %.4f, \"candidates\": %ld, "
+				"\"contacts\": %ld}%s\n",
+				i, f.kinematics, f.update, f.query, f.narrowphase, f.response,
+				f.clear, total(f), f.candidates, f.contacts,
+				i + 1 < (int) frames.size() ? "," : "");
+	}
+	printf("]}\n");
+}
+
+void usage(void) {
+	fprintf(stderr, "usage: bench_world [--broadphase brute|grid_coarse|grid_fine|grid_csr|"
+			"grid_lockfree|grid_hierarchical|grid_hash|quadtree|aabbtree|lbvh|sap_coarse|sap_optimistic|sap_lockfree] "
+			"[--scene uniform|mixed|clustered] "
+			"[--entities N] [--threads N] [--steps N] [--seed N] [--dt T] [--radius R] "
+			"[--format csv|json]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	options opt;
+
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) usage();
+		const char *flag = argv[i];
+		const char *value = argv[++i];
+
+		if (!strcmp(flag, "--broadphase")) opt.broadphase = value;
+		else if (!strcmp(flag, "--scene")) opt.scene = value;
+		else if (!strcmp(flag, "--entities")) opt.entities = std::atoi(value);
+		else if (!strcmp(flag, "--threads")) opt.threads = std::atoi(value);
+		else if (!strcmp(flag, "--steps")) opt.steps = std::atoi(value);
+		else if (!strcmp(flag, "--seed")) opt.seed = std::atoi(value);
+		else if (!strcmp(flag, "--dt")) opt.dt = std::atof(value);
+		else if (!strcmp(flag, "--radius")) opt.radius = std::atof(value);
+		else if (!strcmp(flag, "--format")) opt.format = value;
+		else usage();
+	}
+
+	if (opt.entities < 1 || opt.threads < 1 || opt.steps < 1) usage();
+	if (opt.format != "csv" && opt.format != "json") usage();
+	if (opt.scene != "uniform" && opt.scene != "mixed" && opt.scene != "clustered") usage();
+
+	// the node pools of the lock-free structures never grow, threads wait
+	// forever for nodes once they run out
+	if (opt.broadphase == "grid_lockfree" && grid_nodes(opt, false) > 204800) {
+		fprintf(stderr, "grid_lockfree holds about 17000 entities, fewer with large ones\n");
+		return 1;
+	}
+	if (opt.broadphase == "grid_hierarchical" && grid_nodes(opt, true) > 204800) {
+		fprintf(stderr, "grid_hierarchical holds about 17000 entities\n");
+		return 1;
+	}
+	if (opt.broadphase == "sap_lockfree" && opt.entities > 50000) {
+		fprintf(stderr, "sap_lockfree holds about 50000 entities\n");
+		return 1;
+	}
+
+	std::vector<frame> frames;
+	if (opt.broadphase == "brute") frames = run<BruteForce>(opt);
+	else if (opt.broadphase == "grid_coarse") frames = run<GridPhase<GridC, GridReferenceC*>>(opt);
+	else if (opt.broadphase == "grid_fine") frames = run<GridPhase<GridF, GridReferenceF*>>(opt);
+	else if (opt.broadphase == "grid_csr") frames = run<FlatPhase>(opt);
+	else if (opt.broadphase == "grid_lockfree") frames = run<GridPhase<GridLF, GridNode*>>(opt);
+	else if (opt.broadphase == "grid_hierarchical") frames = run<GridPhase<GridH, GridHRef>>(opt);
+	else if (opt.broadphase == "grid_hash") frames = run<GridPhase<GridHashLF, GridHashRef*>>(opt);
+	else if (opt.broadphase == "quadtree") frames = run<QuadPhase>(opt);
+	else if (opt.broadphase == "aabbtree") frames = run<TreePhase>(opt);
+	else if (opt.broadphase == "lbvh") frames = run<LBVHPhase>(opt);
+	else if (opt.broadphase == "sap_coarse") frames = run<SapPhase<SapListC, SapNodeC*>>(opt);
+	else if (opt.broadphase == "sap_optimistic") frames = run<SapPhase<SapListO, SapNodeO*>>(opt);
+	else if (opt.broadphase == "sap_lockfree") frames = run<SapPhase<SapListLF, uint32_t>>(opt);
+	else usage();
+
+	if (opt.format == "csv") print_csv(opt, frames);
+	else print_json(opt, frames);
+
+	// summary, kept off stdout so the rows can be piped
+	double sum = 0.0;
+	for (auto &f : frames) sum += total(f);
+	fprintf(stderr, "%s: %.4f ms per frame\n", opt.broadphase.c_str(), sum / frames.size());
+	return 0;
+}
@@ -5,13 +5,93 @@
 #include <vector>
 #include <iostream>
 #include <chrono>
+#include <fstream>
 
 #include "grid_lockfree.h"
+#include "grid_csr.h"
+#include "lbvh.h"
+#include "entity_soa.h"
+#include "narrowphase.h"
+#include "islands.h"
+#include "profiler.h"
 #include "threadpool.h"
 
 
+#ifndef NUM_OBJECTS
 #define NUM_OBJECTS 100
+#endif
+#ifndef NUM_THREADS
 #define NUM_THREADS 1
+#endif
+
+// define FLAT_GRID to rebuild a flat grid every frame instead of using the
+// linked list grid
+//#define FLAT_GRID
+
+// define BVH_REBUILD to rebuild a linear BVH every frame and find every pair
+// with one parallel traversal instead of querying a grid per entity
+//#define BVH_REBUILD
+
+// define PERSISTENT_GRID to keep entities in the linked list grid between
+// frames and only move the ones whose buckets changed
+//#define PERSISTENT_GRID
+
+// define CENTER_GRID to insert every entity into the single cell holding its
+// center and query half of the 3 x 3 cells around it
+//#define CENTER_GRID
+
+// define DISCRETE_AABB to insert the AABB at position1 only. By default the
+// broadphase gets the AABB swept from position0 to position1, so the
+// continuous test sees circles which pass through each other in one step.
+//#define DISCRETE_AABB
+
+// define SCALAR_NARROWPHASE to test and resolve every candidate pair from the
+// broadphase callback. By default pairs are collected into buffers and
+// tested in batches before they are resolved. The scalar path writes both
+// entities of a pair from whichever thread found it, so it races with more
+// than one thread.
+//#define SCALAR_NARROWPHASE
+
+// define SLEEPING to stop moving, inserting and querying islands of entities
+// which have been still for SLEEP_FRAMES frames. Sleeping entities are kept
+// in a persistent grid which awake entities query, touching one wakes its
+// island.
+//#define SLEEPING
+
+#if defined(SLEEPING) && (defined(FLAT_GRID) || defined(BVH_REBUILD) || defined(PERSISTENT_GRID) || defined(CENTER_GRID))
+#error "SLEEPING needs the linked list grid rebuilt every frame"
+#endif
+
+// define ADAPTIVE_STEP to split every step into as many substeps as needed
+// for no entity to move further than SUBSTEP_TRAVEL radii in one substep,
+// or out of the 3 x 3 cells of CENTER_GRID
+//#define ADAPTIVE_STEP
+
+// define PROFILE to time every phase of the step and count candidate pairs
+// and contacts per frame. Press P to print the histograms, J to write them
+// to profile.json. Kinematics runs as two passes and the grid clear is
+// waited for, so that every phase is timed on its own.
+//#define PROFILE
+
+// define HARDWARE_COUNTERS with PROFILE to also count cycles, instructions,
+// cache misses and branch misses of every phase where perf_event_open is
+// allowed. Counters are read around every task, which slows down the
+// phases issuing a task per entity several times over.
+//#define HARDWARE_COUNTERS
+
+// define TRACE_POOL to record the tasks and waits of the thread pool. Press
+// T to write the last events of every thread to trace.json, which is also
+// written at exit, for chrome://tracing or Perfetto.
+//#define TRACE_POOL
+
+#if defined(HARDWARE_COUNTERS) && !defined(PROFILE)
+#error "HARDWARE_COUNTERS needs PROFILE"
+#endif
+
+// length of a physics step
+#ifndef TIME_STEP
+#define TIME_STEP 1.f
+#endif
 
 	
 // Collision system in detail
@@ -29,28 +109,52 @@
 //		more accurate to check between old and new positions than with
 //		old position and velocity
 
-struct Entity {
+// kinematic state of an entity, stored in World::body
+struct Body {
 	sf::Vector2f position0;
 	sf::Vector2f position1;
 	sf::Vector2f velocity;
+};
+
+struct Entity {
 	sf::Color color;
+#if defined(FLAT_GRID) || defined(BVH_REBUILD)
+	int gridID;
+#elif defined(CENTER_GRID)
+	GridCell gridID;
+#else
 	GridNode *gridID;
+#endif
+#ifdef SLEEPING
+	GridNode *restID;
+#endif
 	int eid;
 };
 
 struct Collision {
-	Entity &a;
-	Entity &b;
+	Body &a;
+	Body &b;
 	float t;
 };
 
 int radius = 5;
 
+// entities slower than SLEEP_SPEED for SLEEP_FRAMES frames fall asleep
+const float SLEEP_SPEED = 0.05f;
+const int SLEEP_FRAMES = 30;
+
+// furthest an entity moves in one substep, in radii, and most substeps
+// taken by one step
+const float SUBSTEP_TRAVEL = 1.0f;
+const int MAX_SUBSTEPS = 16;
+
 class World {
 	public:
 	void step(float dt);
 	std::vector<Entity> entities;
+	EntitySoA body;
 	private:
+	int substeps(float dt);
 	void kinematics(float dt);
 	void collisions(float dt);
 };
@@ -62,65 +166,188 @@ class World {
 ThreadPool pool(NUM_THREADS);
 
 // collision detection - broadphase
+#ifdef FLAT_GRID
+GridCSR grid(10.0f);
+#elif defined(BVH_REBUILD)
+// 64 entities per task like the other per entity tasks
+LBVH grid(NUM_OBJECTS, 64);
+#elif defined(PERSISTENT_GRID)
+GridLF grid(10.0f, true);
+#elif defined(CENTER_GRID)
+// cells must be as large as the swept AABB of the fastest entity, speeds
+// are at most 5 * sqrt(2)
+GridLF grid(2 * radius + 8 * TIME_STEP);
+#else
 GridLF grid(10.0f);
+#endif
+
+#ifdef SLEEPING
+// sleeping entities, kept between frames
+GridLF resting(10.0f, true);
+Islands islands(NUM_OBJECTS, SLEEP_FRAMES);
+#endif
+
+// candidate pairs of the frame
+PairBuffer pairs;
 
 // total test time
 std::chrono::duration<double> elapsed_seconds;
 
+// entities that changed buckets, summed over all frames
+std::atomic<long> rebucketed(0);
+
+// substeps taken, summed over all frames
+long substeps_taken = 0;
 
+// phases of the step
+enum Phase { PHASE_KINEMATICS, PHASE_WALLS, PHASE_UPDATE, PHASE_QUERY, PHASE_NARROWPHASE, PHASE_RESPONSE, PHASE_CLEAR, PHASE_SLEEP };
+enum Counter { COUNT_CANDIDATES, COUNT_CONTACTS };
 
+#ifdef PROFILE
+Profiler profiler({"kinematics", "walls", "update", "query", "narrowphase", "response", "clear", "sleeping"},
+		{"candidates", "contacts"});
+#endif
+#ifdef HARDWARE_COUNTERS
+PerfCounters perf;
+#endif
 
-// update entity position
-void updateEntityPosition(Entity &entity, float dt) {
-	entity.position0 = entity.position1;
-	entity.position1 += entity.velocity * dt;
+// end a phase of the step
+#ifdef PROFILE
+void lap(Phase phase) {
+	profiler.lap(phase);
 }
 
-// perform collision with wall
-void updateEntityWall(Entity &entity) {
-	auto &p0 = entity.position0;
-	auto &p1 = entity.position1;
-	auto &velocity = entity.velocity;
+void count(Counter counter, long n) {
+	profiler.count(counter, n);
+}
+#else
+void lap(Phase) {
+}
 
-	// check for collisions with the screen
-	if (p1.x > 800 - radius) {
-		velocity.x *= -1.f;
-		p1 = p0;
-	}
-	if (p1.x < 0 + radius) {
-		velocity.x *= -1.f;
-		p1 = p0;
-	}
-	if (p1.y > 600 - radius) {
-		velocity.y *= -1.f;
-		p1 = p0;
-	}
-	if (p1.y < 0 + radius) {
-		velocity.y *= -1.f;
-		p1 = p0;
-	}
+void count(Counter, long) {
+}
+#endif
+
+
+
+
+// read the kinematic state of an entity
+Body loadBody(EntitySoA &body, int i) {
+	Body b;
+	b.position0 = sf::Vector2f(body.x0[i], body.y0[i]);
+	b.position1 = sf::Vector2f(body.x1[i], body.y1[i]);
+	b.velocity = sf::Vector2f(body.vx[i], body.vy[i]);
+	return b;
+}
+
+// write back the end position and velocity of an entity
+void storeBody(EntitySoA &body, int i, Body &b) {
+	body.x1[i] = b.position1.x;
+	body.y1[i] = b.position1.y;
+	body.vx[i] = b.velocity.x;
+	body.vy[i] = b.velocity.y;
+}
+
+// AABB of an entity given to the broadphase
+void entityAABB(EntitySoA &body, int i, float &x1, float &y1, float &x2, float &y2) {
+	auto p1 = sf::Vector2f(body.x1[i], body.y1[i]);
+#ifdef DISCRETE_AABB
+	x1 = p1.x - radius;
+	y1 = p1.y - radius;
+	x2 = p1.x + radius;
+	y2 = p1.y + radius;
+#else
+	auto p0 = sf::Vector2f(body.x0[i], body.y0[i]);
+	x1 = std::min(p0.x, p1.x) - radius;
+	y1 = std::min(p0.y, p1.y) - radius;
+	x2 = std::max(p0.x, p1.x) + radius;
+	y2 = std::max(p0.y, p1.y) + radius;
+#endif
 }
 
 // update entity on the grid
-void updateGrid(Entity &entity) {
+void updateGrid(Entity &entity, EntitySoA &body) {
+	float x1, y1, x2, y2;
+	entityAABB(body, entity.eid, x1, y1, x2, y2);
+
 	// insert into grid
-	auto x1 = entity.position1.x - radius;
-	auto y1 = entity.position1.y - radius;
-	auto x2 = entity.position1.x + radius;
-	auto y2 = entity.position1.y + radius;
+#ifdef PERSISTENT_GRID
+	// inserted with the swept AABB of its first step, moved afterwards
+	if (!entity.gridID) {
+		entity.gridID = grid.add(entity.eid, x1, y1, x2, y2);
+		rebucketed.fetch_add(1);
+	} else if (grid.move(entity.gridID, x1, y1, x2, y2)) {
+		rebucketed.fetch_add(1);
+	}
+#elif defined(CENTER_GRID)
+	entity.gridID = grid.add_center(entity.eid, x1, y1, x2, y2);
+#else
 	entity.gridID = grid.add(entity.eid, x1, y1, x2, y2);
+#endif
 }
 
 
-void collisionCallback(std::vector<Entity> &entities, float dt, int i, int j);
-
-// query entity on the grid
-void queryGrid(Entity &entity, std::vector<Entity> &entities, float dt) {
-	grid.query_callback(entity.gridID, std::bind(collisionCallback, std::ref(entities), dt, std::placeholders::_1, std::placeholders::_2));
+void collisionCallback(EntitySoA &body, float dt, int i, int j);
+
+// query entity on the grid, body and dt are only used by the scalar
+// narrowphase and sleeping
+void queryGrid(Entity &entity, [[maybe_unused]] EntitySoA &body, [[maybe_unused]] float dt) {
+#ifdef SCALAR_NARROWPHASE
+	auto func = std::bind(collisionCallback, std::ref(body), dt, std::placeholders::_1, std::placeholders::_2);
+#else
+	auto func = std::bind(&PairBuffer::push, &pairs, std::placeholders::_1, std::placeholders::_2);
+#endif
+#ifdef CENTER_GRID
+	grid.query_cell(entity.gridID, func);
+#else
+	grid.query_callback(entity.gridID, func);
+#endif
+#ifdef SLEEPING
+	// sleeping entities are only found from awake ones
+	float x1, y1, x2, y2;
+	entityAABB(body, entity.eid, x1, y1, x2, y2);
+	resting.query_region(entity.eid, x1, y1, x2, y2, func);
+#endif
+}
 
-	// free refernce list
-	grid.returnRefNodes(entity.gridID);
+#ifdef BVH_REBUILD
+// pairs found in one chunk of the bvh leaves, body and dt are only used by
+// the scalar narrowphase
+void queryChunk(int c, [[maybe_unused]] EntitySoA &body, [[maybe_unused]] float dt) {
+	for (auto &p : grid.pairs(c)) {
+#ifdef SCALAR_NARROWPHASE
+		collisionCallback(body, dt, p.first, p.second);
+#else
+		pairs.push(p.first, p.second);
+#endif
+	}
+}
+#endif
+
+#ifdef SLEEPING
+// wake touched islands and put still ones to sleep
+void updateSleeping(std::vector<Entity> &entities, EntitySoA &body) {
+	islands.update([&body](int i) {
+		auto speed2 = body.vx[i] * body.vx[i] + body.vy[i] * body.vy[i];
+		return speed2 < SLEEP_SPEED * SLEEP_SPEED;
+	});
+
+	// woken entities are moved and added to the grid again
+	for (int i : islands.woke_up()) {
+		resting.remove(entities[i].restID);
+	}
+	resting.purge();
+
+	// sleeping entities stop where they are
+	for (int i : islands.fell_asleep()) {
+		body.vx[i] = 0.f;
+		body.vy[i] = 0.f;
+		body.x0[i] = body.x1[i];
+		body.y0[i] = body.y1[i];
+		entities[i].restID = resting.add(i, body.x1[i] - radius, body.y1[i] - radius, body.x1[i] + radius, body.y1[i] + radius);
+	}
 }
+#endif
 
 
 
@@ -130,8 +357,23 @@ void World::step(float dt) {
 	std::chrono::time_point<std::chrono::system_clock> start, end;
 
 	start = std::chrono::system_clock::now();
+#ifdef PROFILE
+	profiler.begin();
+#endif
+#ifdef ADAPTIVE_STEP
+	int n = substeps(dt);
+	for (int i = 0; i < n; i++) {
+		kinematics(dt / n);
+		collisions(dt / n);
+	}
+	substeps_taken += n;
+#else
 	kinematics(dt);
 	collisions(dt);
+#endif
+#ifdef PROFILE
+	profiler.end();
+#endif
 	end = std::chrono::system_clock::now();
 
 	std::chrono::duration<double> interval_seconds = end - start;
@@ -139,11 +381,41 @@ void World::step(float dt) {
 	elapsed_seconds += interval_seconds;
 }
 
+/*
+ * number of substeps for the fastest entity to move at most SUBSTEP_TRAVEL
+ * radii per substep
+ */
+int World::substeps(float dt) {
+	auto travel = SUBSTEP_TRAVEL * radius;
+#ifdef CENTER_GRID
+	// the swept AABB must fit into a cell
+	travel = std::min(travel, grid.cellSize() - 2.f * radius);
+#endif
+	auto distance = std::sqrt(body.max_speed2(0, body.size())) * dt;
+	int n = std::ceil(distance / travel);
+	return std::min(std::max(n, 1), MAX_SUBSTEPS);
+}
+
 void World::kinematics(float dt) {
-	for (auto &entity : entities) {
-		pool.add(std::bind(updateEntityPosition, std::ref(entity), dt));
-	}
-	pool.wait();
+	// integrate positions and bounce off the screen edges
+#ifdef PROFILE
+	auto integrate = [this, dt](int begin, int end) { body.integrate(begin, end, dt); };
+	auto walls = [this](int begin, int end) { body.walls(begin, end, radius, 800, 600); };
+#ifdef SLEEPING
+	body.parallel_for(pool, islands.awake(), integrate);
+	lap(PHASE_KINEMATICS);
+	body.parallel_for(pool, islands.awake(), walls);
+#else
+	body.parallel_for(pool, integrate);
+	lap(PHASE_KINEMATICS);
+	body.parallel_for(pool, walls);
+#endif
+	lap(PHASE_WALLS);
+#elif defined(SLEEPING)
+	body.kinematics(pool, dt, radius, 800, 600, islands.awake());
+#else
+	body.kinematics(pool, dt, radius, 800, 600);
+#endif
 }
 
 float perp(sf::Vector2f &a, sf::Vector2f &b) {
@@ -176,7 +448,15 @@ void reflect(sf::Vector2f &a, sf::Vector2f n) {
 	a += -2.f * std::max(dot(a, n), 0.f) * n;
 }
 
-bool circle_circle_ccd_check(Entity &a, Entity &b, float dt) {
+/*
+ * Time of first contact between two circles moving in a straight line from
+ * position0 to position1 over a step of length dt.
+ *
+ * returns dt if they do not touch during the step, or if they already
+ * overlap at its start. Overlapping circles are separated by reflection
+ * and are not moved back.
+ */
+float circle_circle_ccd_time(Body &a, Body &b, float dt) {
 	// a is moving, b is still, distance from b to a
 	auto d = a.position0 - b.position0;
 	// relative velocity, a is moving, b is still
@@ -184,51 +464,31 @@ bool circle_circle_ccd_check(Entity &a, Entity &b, float dt) {
 	auto bv = b.position1 - b.position0;
 	auto v = av - bv;
 
-	// point at closest contact between a's velocity and b
-	auto closest = perp(d, v);
-	// time of closest contact
-	auto t = proj(d, v);
-	if (closest <= radius) {
-		// two points of contact
-		auto t1 = t - rd(radius * 2, closest);
-		auto t2 = t + rd(radius * 2, closest);
-		// scale by speed
-		t1 /= std::sqrt(v.x * v.x + v.y * v.y);
-		t2 /= std::sqrt(v.x * v.x + v.y * v.y);
-		if (t1 > 0.f && t1 <= dt) return true;
-		if (t2 > 0.f && t2 <= dt) return true;
-	}
-	return false;
-}
+	// already overlapping
+	if (dot(d, d) < 4.0f * radius * radius) return dt;
 
-float circle_circle_ccd_time(Entity &a, Entity &b, float dt) {
-	// a is moving, b is still, distance from b to a
-	auto d = a.position0 - b.position0;
-	// relative velocity, a is moving, b is still
-	auto av = a.position1 - a.position0;
-	auto bv = b.position1 - b.position0;
-	auto v = av - bv;
+	// not moving relative to each other
+	auto speed = std::sqrt(v.x * v.x + v.y * v.y);
+	if (speed == 0.f) return dt;
+
+	// distance between b and the closest point on a's path
+	auto closest = std::fabs(perp(d, v));
+	if (closest > radius * 2) return dt;
+
+	// distance along the path to the closest point, d points from b to a
+	auto t = -proj(d, v);
+
+	// first point of contact, scaled by the length of the path into time
+	auto t1 = (t - rd(radius * 2, closest)) / speed * dt;
+	if (t1 < 0.f || t1 >= dt) return dt;
+	return t1;
+}
 
-	// point at closest contact between a's velocity and b
-	auto closest = perp(d, v);
-	// time of closest contact
-	auto t = proj(d, v);
-
-	// two points of contact
-	auto t1 = t - rd(radius * 2, closest);
-	auto t2 = t + rd(radius * 2, closest);
-	// scale by speed into time
-	t1 /= std::sqrt(v.x * v.x + v.y * v.y);
-	t2 /= std::sqrt(v.x * v.x + v.y * v.y);
-
-	// return lowest time of impact
-	auto ft = dt;
-	if (t1 > 0.f && t1 <= dt && t1 < ft) ft = t1;
-	if (t2 > 0.f && t2 <= dt && t2 < ft) ft = t2;
-	return ft;
+bool circle_circle_ccd_check(Body &a, Body &b, float dt) {
+	return circle_circle_ccd_time(a, b, dt) < dt;
 }
 
-bool circle_circle2(Entity &a, Entity &b, float dt) {
+bool circle_circle2(Body &a, Body &b, float dt) {
 	return circle_circle_ccd_check(a, b, dt);
 }
 
@@ -238,7 +498,7 @@ bool circle_circle2(Entity &a, Entity &b, float dt) {
  * If two circles are moving fast enough, they will jump through each other.
  * This is known as the tunneling problem.
  */
-bool circle_circle(Entity &a, Entity &b, float dt) {
+bool circle_circle(Body &a, Body &b, float) {
 	auto d = a.position1 - b.position1;
 	return ((d.x * d.x) + (d.y * d.y)) < (4.0f * radius * radius);
 }
@@ -246,27 +506,47 @@ bool circle_circle(Entity &a, Entity &b, float dt) {
 
 
 
+/*
+ * Move two touching circles back to the time of impact t, a fraction of the
+ * step, and reflect their velocities
+ */
+void resolveContact(EntitySoA &body, int i, int j, float t) {
+	auto a = loadBody(body, i);
+	auto b = loadBody(body, j);
+
+	// move back to the time of impact
+	a.position1 = a.position0 + t * (a.position1 - a.position0);
+	b.position1 = b.position0 + t * (b.position1 - b.position0);
+
+	// simple reflection, does not perform transfer of momentum
+	// normal vector from a to b
+	auto n = b.position1 - a.position1;
+	n /= std::sqrt(n.x * n.x + n.y * n.y);
+	reflect(a.velocity, n);
+
+	// normal vector from b to a
+	n = a.position1 - b.position1;
+	n /= std::sqrt(n.x * n.x + n.y * n.y);
+	reflect(b.velocity, n);
+
+	storeBody(body, i, a);
+	storeBody(body, j, b);
+
+#ifdef SLEEPING
+	islands.contact(i, j);
+#endif
+}
+
 /*
  * Used by threadpool to handle multithreaded collisions
  */
-void collisionCallback(std::vector<Entity> &entities, float dt, int i, int j) {
-	auto &a = entities.at(i);
-	auto &b = entities.at(j);
-	if (circle_circle(a, b, dt)) {
-		auto t = circle_circle_ccd_time(a, b, dt);
-		a.position1 = a.position0 + t * (a.position1 - a.position0);
-		b.position1 = b.position0 + t * (b.position1 - b.position0);
-
-		// simple reflection, does not perform transfer of momentum
-		// normal vector from a to b
-		auto n = b.position1 - a.position1;
-		n /= std::sqrt(n.x * n.x + n.y * n.y);
-		reflect(a.velocity, n);
-
-		// normal vector from b to a
-		n = a.position1 - b.position1;
-		n /= std::sqrt(n.x * n.x + n.y * n.y);
-		reflect(b.velocity, n);
+void collisionCallback(EntitySoA &body, float dt, int i, int j) {
+	auto a = loadBody(body, i);
+	auto b = loadBody(body, j);
+	// circles touching at the end of the step, or passing through each
+	// other during it
+	if (circle_circle(a, b, dt) || circle_circle2(a, b, dt)) {
+		resolveContact(body, i, j, circle_circle_ccd_time(a, b, dt) / dt);
 	}
 }
 
@@ -277,25 +557,75 @@ void collisionCallback(std::vector<Entity> &entities, float dt, int i, int j) {
 
 
 void World::collisions(float dt) {
-	// collision detection will walls
-	for (auto &entity : entities) {
-		pool.add(std::bind(updateEntityWall, std::ref(entity)));
-	}
-	pool.wait();
-	
 	// update grid
+#ifdef SLEEPING
+	for (int i : islands.awake()) {
+		pool.add(std::bind(updateGrid, std::ref(entities[i]), std::ref(body)), "updateGrid");
+	}
+#else
 	for (auto &entity : entities) {
-		pool.add(std::bind(updateGrid, std::ref(entity)));
+		pool.add(std::bind(updateGrid, std::ref(entity), std::ref(body)), "updateGrid");
 	}
-	pool.wait();
+#endif
+	pool.wait("updateGrid");
+
+#ifdef FLAT_GRID
+	// scatter entities into contiguous buckets
+	grid.build(pool);
+#elif defined(BVH_REBUILD)
+	// sort, emit and refit the tree over this frame's boxes
+	grid.build(pool);
+#endif
+	lap(PHASE_UPDATE);
 
 	// perform collision detection between balls
+#ifdef BVH_REBUILD
+	grid.find_pairs(pool);
+	for (int c = 0; c < grid.num_chunks(); c++) {
+		pool.add(std::bind(queryChunk, c, std::ref(body), dt), "queryChunk");
+	}
+#elif defined(SLEEPING)
+	for (int i : islands.awake()) {
+		pool.add(std::bind(queryGrid, std::ref(entities[i]), std::ref(body), dt), "queryGrid");
+	}
+#else
 	for (int i = 0; i < entities.size(); i++) {
-		pool.add(std::bind(queryGrid, std::ref(entities[i]), std::ref(entities), dt));
+		pool.add(std::bind(queryGrid, std::ref(entities[i]), std::ref(body), dt), "queryGrid");
 	}
-	pool.wait();
-
+#endif
+	pool.wait("queryGrid");
+	lap(PHASE_QUERY);
+
+#ifndef SCALAR_NARROWPHASE
+	// time of impact of every candidate pair, then resolve the ones touching
+	// in batches of pairs which share no entity
+	count(COUNT_CANDIDATES, pairs.size());
+	pairs.narrowphase(pool, body, radius);
+	lap(PHASE_NARROWPHASE);
+	pairs.resolve(pool, entities.size(), std::bind(resolveContact, std::ref(body), std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+	count(COUNT_CONTACTS, pairs.touching());
+	pairs.clear();
+	lap(PHASE_RESPONSE);
+#endif
+
+#ifdef PERSISTENT_GRID
+	// unlink buckets left behind by moved entities
+	grid.purge();
+#elif defined(FLAT_GRID) || defined(BVH_REBUILD)
 	grid.clear();
+#else
+	// finished by the wait of the next frame's kinematics
+	grid.clear(pool);
+#ifdef PROFILE
+	pool.wait("GridLF::clear");
+#endif
+#endif
+	lap(PHASE_CLEAR);
+
+#ifdef SLEEPING
+	updateSleeping(entities, body);
+	lap(PHASE_SLEEP);
+#endif
 }
 
 int main() {
@@ -308,21 +638,42 @@ int main() {
 	// initialize entities
 	World world;
 	world.entities.resize(NUM_OBJECTS);
+	world.body.resize(NUM_OBJECTS);
 
+	auto &body = world.body;
 	int id = 0;
 	for (auto &entity : world.entities) {
-		entity.position1.x = dist3(mt);
-		entity.position1.y = dist3(mt);
-		entity.velocity.x = dist(mt);
-		entity.velocity.y = dist(mt);
+		auto i = id;
+		body.x1[i] = dist3(mt);
+		body.y1[i] = dist3(mt);
+		body.vx[i] = dist(mt);
+		body.vy[i] = dist(mt);
 		entity.color = sf::Color(dist2(mt), dist2(mt), dist2(mt));
 		entity.eid = id++;
+
+#ifdef PERSISTENT_GRID
+		// inserted by the first updateGrid
+		entity.gridID = nullptr;
+#endif
 	}
 
 	// create window
 	sf::RenderWindow window(sf::VideoMode(800, 600), "Collision Test");
 	window.setFramerateLimit(60);
 
+#ifdef HARDWARE_COUNTERS
+	if (perf.available()) {
+		pool.observe(&perf);
+		profiler.use(&perf);
+	} else {
+		std::cout << "hardware counters unavailable: " << perf.error() << std::endl;
+	}
+#endif
+
+#ifdef TRACE_POOL
+	pool.trace(true);
+#endif
+
 	// initialize threadpool
 	pool.start();
 
@@ -331,18 +682,38 @@ int main() {
 		sf::Event event;
 
 		// check for window exit
-		while (window.pollEvent(event))
+		while (window.pollEvent(event)) {
 			if (event.type == sf::Event::Closed)
 				window.close();
+#ifdef PROFILE
+			// export the profile so far
+			if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::P) {
+				profiler.print(std::cout);
+			}
+			if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::J) {
+				std::ofstream out("profile.json");
+				profiler.json(out);
+			}
+#endif
+#ifdef TRACE_POOL
+			// write the tasks of the last frames
+			if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::T) {
+				// the grid clear of the last frame may still be running
+				pool.wait("dump_trace");
+				std::ofstream out("trace.json");
+				pool.dump_trace(out);
+			}
+#endif
+		}
 
 		// step physics engine
-		world.step(1.f);
+		world.step(TIME_STEP);
 
 		// render
 		window.clear(sf::Color::Black);
 		for (auto &entity : world.entities) {
 			// check for collisions on the screen
-			auto &position = entity.position1;
+			auto position = sf::Vector2f(body.x1[entity.eid], body.y1[entity.eid]);
 			auto rshift = sf::Vector2f(radius, radius);
 			auto &color = entity.color;
 
@@ -355,7 +726,20 @@ int main() {
 	}
 
 	pool.stop();
+#ifdef TRACE_POOL
+	std::ofstream trace("trace.json");
+	pool.dump_trace(trace);
+#endif
 
 	std::cout << "TIME: " << elapsed_seconds.count() << std::endl;
+#ifdef PROFILE
+	profiler.print(std::cout);
+#endif
+#ifdef ADAPTIVE_STEP
+	std::cout << "SUBSTEPS: " << substeps_taken / 300.0 << std::endl;
+#endif
+#ifdef PERSISTENT_GRID
+	std::cout << "SKIPPED: " << 1.0 - rebucketed / (300.0 * NUM_OBJECTS) << std::endl;
+#endif
 	return 0;
 }
@@ -5,8 +5,10 @@
 #include <vector>
 #include <iostream>
 #include <chrono>
+#include <fstream>
 
 #include "sap_lockfree.h"
+#include "islands.h"
 #include "threadpool.h"
 
 
@@ -19,6 +21,27 @@
 #define NUM_OBJECTS 500
 #define NUM_THREADS 1
 
+// define DISCRETE_AABB to insert the AABB at position1 only. By default the
+// broadphase gets the AABB swept from position0 to position1, so the
+// continuous test sees circles which pass through each other in one step.
+//#define DISCRETE_AABB
+
+// define SLEEPING to stop moving and updating islands of entities which
+// have been still for SLEEP_FRAMES frames, touching one wakes its island.
+// Sleeping entities are still queried, a pair is only reported from the
+// entity further left, but pairs of two sleeping entities are skipped.
+//#define SLEEPING
+
+// define TRACE_POOL to record the tasks and waits of the thread pool. Press
+// T to write the last events of every thread to trace.json, which is also
+// written at exit, for chrome://tracing or Perfetto.
+//#define TRACE_POOL
+
+// length of a physics step
+#ifndef TIME_STEP
+#define TIME_STEP 1.f
+#endif
+
 	
 // Collision system in detail
 // integrate positions
@@ -51,6 +74,10 @@ struct Collision {
 
 int radius = 6;
 
+// entities slower than SLEEP_SPEED for SLEEP_FRAMES frames fall asleep
+const float SLEEP_SPEED = 0.05f;
+const int SLEEP_FRAMES = 30;
+
 class World {
 	public:
 	void step(float dt);
@@ -69,6 +96,10 @@ ThreadPool pool(NUM_THREADS);
 // collision detection - broadphase
 SapListLF list;
 
+#ifdef SLEEPING
+Islands islands(NUM_OBJECTS, SLEEP_FRAMES);
+#endif
+
 // total test time
 std::chrono::duration<double> elapsed_seconds;
 
@@ -107,7 +138,15 @@ void updateEntityWall(Entity &entity) {
 
 // update entity on the list
 void updateSapList(Entity &entity) {
+#ifdef DISCRETE_AABB
 	entity.sapID = list.update(entity.sapID, entity.position1.x - radius, radius * 2.0f);
+#else
+	auto &p0 = entity.position0;
+	auto &p1 = entity.position1;
+	auto x = std::min(p0.x, p1.x) - radius;
+	auto width = std::fabs(p1.x - p0.x) + radius * 2.0f;
+	entity.sapID = list.update(entity.sapID, x, width);
+#endif
 }
 
 
@@ -118,6 +157,22 @@ void querySapList(Entity &entity, std::vector<Entity> &entities, float dt) {
 	list.query_callback(entity.sapID, std::bind(collisionCallback, std::ref(entities), dt, std::placeholders::_1, std::placeholders::_2));
 }
 
+#ifdef SLEEPING
+// wake touched islands and put still ones to sleep
+void updateSleeping(std::vector<Entity> &entities) {
+	islands.update([&entities](int i) {
+		auto &v = entities[i].velocity;
+		return v.x * v.x + v.y * v.y < SLEEP_SPEED * SLEEP_SPEED;
+	});
+
+	// sleeping entities stop where they are
+	for (int i : islands.fell_asleep()) {
+		entities[i].velocity = sf::Vector2f(0.f, 0.f);
+		entities[i].position0 = entities[i].position1;
+	}
+}
+#endif
+
 
 
 
@@ -136,10 +191,16 @@ void World::step(float dt) {
 }
 
 void World::kinematics(float dt) {
+#ifdef SLEEPING
+	for (int i : islands.awake()) {
+		pool.add(std::bind(updateEntityPosition, std::ref(entities[i]), dt), "updateEntityPosition");
+	}
+#else
 	for (auto &entity : entities) {
-		pool.add(std::bind(updateEntityPosition, std::ref(entity), dt));
+		pool.add(std::bind(updateEntityPosition, std::ref(entity), dt), "updateEntityPosition");
 	}
-	pool.wait();
+#endif
+	pool.wait("updateEntityPosition");
 }
 
 float perp(sf::Vector2f &a, sf::Vector2f &b) {
@@ -172,7 +233,15 @@ void reflect(sf::Vector2f &a, sf::Vector2f n) {
 	a += -2.f * std::max(dot(a, n), 0.f) * n;
 }
 
-bool circle_circle_ccd_check(Entity &a, Entity &b, float dt) {
+/*
+ * Time of first contact between two circles moving in a straight line from
+ * position0 to position1 over a step of length dt.
+ *
+ * returns dt if they do not touch during the step, or if they already
+ * overlap at its start. Overlapping circles are separated by reflection
+ * and are not moved back.
+ */
+float circle_circle_ccd_time(Entity &a, Entity &b, float dt) {
 	// a is moving, b is still, distance from b to a
 	auto d = a.position0 - b.position0;
 	// relative velocity, a is moving, b is still
@@ -180,48 +249,28 @@ bool circle_circle_ccd_check(Entity &a, Entity &b, float dt) {
 	auto bv = b.position1 - b.position0;
 	auto v = av - bv;
 
-	// point at closest contact between a's velocity and b
-	auto closest = perp(d, v);
-	// time of closest contact
-	auto t = proj(d, v);
-	if (closest <= radius) {
-		// two points of contact
-		auto t1 = t - rd(radius * 2, closest);
-		auto t2 = t + rd(radius * 2, closest);
-		// scale by speed
-		t1 /= std::sqrt(v.x * v.x + v.y * v.y);
-		t2 /= std::sqrt(v.x * v.x + v.y * v.y);
-		if (t1 > 0.f && t1 <= dt) return true;
-		if (t2 > 0.f && t2 <= dt) return true;
-	}
-	return false;
-}
+	// already overlapping
+	if (dot(d, d) < 4.0f * radius * radius) return dt;
 
-float circle_circle_ccd_time(Entity &a, Entity &b, float dt) {
-	// a is moving, b is still, distance from b to a
-	auto d = a.position0 - b.position0;
-	// relative velocity, a is moving, b is still
-	auto av = a.position1 - a.position0;
-	auto bv = b.position1 - b.position0;
-	auto v = av - bv;
+	// not moving relative to each other
+	auto speed = std::sqrt(v.x * v.x + v.y * v.y);
+	if (speed == 0.f) return dt;
+
+	// distance between b and the closest point on a's path
+	auto closest = std::fabs(perp(d, v));
+	if (closest > radius * 2) return dt;
+
+	// distance along the path to the closest point, d points from b to a
+	auto t = -proj(d, v);
 
-	// point at closest contact between a's velocity and b
-	auto closest = perp(d, v);
-	// time of closest contact
-	auto t = proj(d, v);
-
-	// two points of contact
-	auto t1 = t - rd(radius * 2, closest);
-	auto t2 = t + rd(radius * 2, closest);
-	// scale by speed into time
-	t1 /= std::sqrt(v.x * v.x + v.y * v.y);
-	t2 /= std::sqrt(v.x * v.x + v.y * v.y);
-
-	// return lowest time of impact
-	auto ft = dt;
-	if (t1 > 0.f && t1 <= dt && t1 < ft) ft = t1;
-	if (t2 > 0.f && t2 <= dt && t2 < ft) ft = t2;
-	return ft;
+	// first point of contact, scaled by the length of the path into time
+	auto t1 = (t - rd(radius * 2, closest)) / speed * dt;
+	if (t1 < 0.f || t1 >= dt) return dt;
+	return t1;
+}
+
+bool circle_circle_ccd_check(Entity &a, Entity &b, float dt) {
+	return circle_circle_ccd_time(a, b, dt) < dt;
 }
 
 bool circle_circle2(Entity &a, Entity &b, float dt) {
@@ -246,10 +295,16 @@ bool circle_circle(Entity &a, Entity &b, float dt) {
  * Used by threadpool to handle multithreaded collisions
  */
 void collisionCallback(std::vector<Entity> &entities, float dt, int i, int j) {
+#ifdef SLEEPING
+	if (islands.sleeping(i) && islands.sleeping(j)) return;
+#endif
 	auto &a = entities.at(i);
 	auto &b = entities.at(j);
-	if (circle_circle(a, b, dt)) {
-		auto t = circle_circle_ccd_time(a, b, dt);
+	// circles touching at the end of the step, or passing through each
+	// other during it
+	if (circle_circle(a, b, dt) || circle_circle2(a, b, dt)) {
+		// move back to the time of impact
+		auto t = circle_circle_ccd_time(a, b, dt) / dt;
 		a.position1 = a.position0 + t * (a.position1 - a.position0);
 		b.position1 = b.position0 + t * (b.position1 - b.position0);
 
@@ -263,6 +318,10 @@ void collisionCallback(std::vector<Entity> &entities, float dt, int i, int j) {
 		n = a.position1 - b.position1;
 		n /= std::sqrt(n.x * n.x + n.y * n.y);
 		reflect(b.velocity, n);
+
+#ifdef SLEEPING
+		islands.contact(i, j);
+#endif
 	}
 }
 
@@ -273,23 +332,41 @@ void collisionCallback(std::vector<Entity> &entities, float dt, int i, int j) {
 
 
 void World::collisions(float dt) {
+#ifdef SLEEPING
+	// collision detection will walls
+	for (int i : islands.awake()) {
+		pool.add(std::bind(updateEntityWall, std::ref(entities[i])), "updateEntityWall");
+	}
+	pool.wait("updateEntityWall");
+
+	// update saplist, sleeping entities keep their place
+	for (int i : islands.awake()) {
+		pool.add(std::bind(updateSapList, std::ref(entities[i])), "updateSapList");
+	}
+	pool.wait("updateSapList");
+#else
 	// collision detection will walls
 	for (auto &entity : entities) {
-		pool.add(std::bind(updateEntityWall, std::ref(entity)));
+		pool.add(std::bind(updateEntityWall, std::ref(entity)), "updateEntityWall");
 	}
-	pool.wait();
+	pool.wait("updateEntityWall");
 
 	// update saplist
 	for (auto &entity : entities) {
-		pool.add(std::bind(updateSapList, std::ref(entity)));
+		pool.add(std::bind(updateSapList, std::ref(entity)), "updateSapList");
 	}
-	pool.wait();
+	pool.wait("updateSapList");
+#endif
 
 	// perform collision detection between balls
 	for (int i = 0; i < entities.size(); i++) {
-		pool.add(std::bind(querySapList, std::ref(entities[i]), std::ref(entities), dt));
+		pool.add(std::bind(querySapList, std::ref(entities[i]), std::ref(entities), dt), "querySapList");
 	}
-	pool.wait();
+	pool.wait("querySapList");
+
+#ifdef SLEEPING
+	updateSleeping(entities);
+#endif
 }
 
 int main() {
@@ -319,6 +396,10 @@ int main() {
 	sf::RenderWindow window(sf::VideoMode(800, 600), "Collision Test");
 	window.setFramerateLimit(60);
 
+#ifdef TRACE_POOL
+	pool.trace(true);
+#endif
+
 	// initialize threadpool
 	pool.start();
 
@@ -327,12 +408,20 @@ int main() {
 		sf::Event event;
 
 		// check for window exit
-		while (window.pollEvent(event))
+		while (window.pollEvent(event)) {
 			if (event.type == sf::Event::Closed)
 				window.close();
+#ifdef TRACE_POOL
+			// write the tasks of the last frames
+			if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::T) {
+				std::ofstream out("trace.json");
+				pool.dump_trace(out);
+			}
+#endif
+		}
 
 		// step physics engine
-		world.step(1.f);
+		world.step(TIME_STEP);
 
 		// render
 		window.clear(sf::Color::Black);
@@ -352,6 +441,10 @@ int main() {
 
 	// stop threadpool
 	pool.stop();
+#ifdef TRACE_POOL
+	std::ofstream trace("trace.json");
+	pool.dump_trace(trace);
+#endif
 
 	std::cout << "TIME: " << elapsed_seconds.count() << std::endl;
 	return 0;
@@ -0,0 +1,240 @@
+#ifndef ENTITY_SOA
+#define ENTITY_SOA
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "threadpool.h"
+
+/*
+ * Kinematic state of entities stored as a structure of arrays.
+ *
+ * Every field has its own array aligned to 32 bytes, so integration and
+ * wall handling stream through memory with SIMD instructions instead of
+ * touching one entity at a time. AVX is used when compiled with -mavx or
+ * -mavx2, SSE otherwise, and plain loops on other targets.
+ */
+class EntitySoA {
+	int count;
+	int capacity;
+
+	float* allocate(int n) {
+		// aligned_alloc needs a multiple of the alignment
+		size_t bytes = ((n * sizeof(float) + 31) / 32) * 32;
+		auto *p = (float*) std::aligned_alloc(32, bytes);
+		std::memset(p, 0, bytes);
+		return p;
+	};
+
+	/*
+	 * bounce off one edge, entities past the edge flip one component of
+	 * their velocity and move back to position0
+	 */
+	void bounce(int begin, int end, float edge, bool above, float *p, float *v) {
+		int i = begin;
+#if defined(__AVX__)
+		const __m256 e = _mm256_set1_ps(edge);
+		const __m256 sign = _mm256_set1_ps(-0.0f);
+		for (; i + 8 <= end; i += 8) {
+			auto m = above ? _mm256_cmp_ps(_mm256_loadu_ps(p + i), e, _CMP_GT_OQ)
+			               : _mm256_cmp_ps(_mm256_loadu_ps(p + i), e, _CMP_LT_OQ);
+			auto vel = _mm256_loadu_ps(v + i);
+			_mm256_storeu_ps(v + i, _mm256_xor_ps(vel, _mm256_and_ps(m, sign)));
+			_mm256_storeu_ps(x1 + i, _mm256_blendv_ps(_mm256_loadu_ps(x1 + i), _mm256_loadu_ps(x0 + i), m));
+			_mm256_storeu_ps(y1 + i, _mm256_blendv_ps(_mm256_loadu_ps(y1 + i), _mm256_loadu_ps(y0 + i), m));
+		}
+#elif defined(__SSE2__)
+		const __m128 e = _mm_set1_ps(edge);
+		const __m128 sign = _mm_set1_ps(-0.0f);
+		for (; i + 4 <= end; i += 4) {
+			auto m = above ? _mm_cmpgt_ps(_mm_loadu_ps(p + i), e)
+			               : _mm_cmplt_ps(_mm_loadu_ps(p + i), e);
+			auto vel = _mm_loadu_ps(v + i);
+			_mm_storeu_ps(v + i, _mm_xor_ps(vel, _mm_and_ps(m, sign)));
+			// select position0 where the mask is set
+			auto px = _mm_loadu_ps(x1 + i);
+			auto py = _mm_loadu_ps(y1 + i);
+			px = _mm_or_ps(_mm_and_ps(m, _mm_loadu_ps(x0 + i)), _mm_andnot_ps(m, px));
+			py = _mm_or_ps(_mm_and_ps(m, _mm_loadu_ps(y0 + i)), _mm_andnot_ps(m, py));
+			_mm_storeu_ps(x1 + i, px);
+			_mm_storeu_ps(y1 + i, py);
+		}
+#endif
+		for (; i < end; i++) {
+			if (above ? p[i] > edge : p[i] < edge) {
+				v[i] *= -1.f;
+				x1[i] = x0[i];
+				y1[i] = y0[i];
+			}
+		}
+	};
+
+	public:
+
+	// position at the start and end of the step
+	float *x0, *y0;
+	float *x1, *y1;
+
+	float *vx, *vy;
+
+	EntitySoA(int n = 0) {
+		count = 0;
+		capacity = 0;
+		x0 = y0 = x1 = y1 = vx = vy = nullptr;
+		resize(n);
+	};
+
+	~EntitySoA() {
+		for (auto *p : {x0, y0, x1, y1, vx, vy}) std::free(p);
+	};
+
+	EntitySoA(const EntitySoA&) = delete;
+	EntitySoA& operator=(const EntitySoA&) = delete;
+
+	/*
+     * change the number of entities, new entities are zeroed
+     */
+	void resize(int n) {
+		if (n > capacity) {
+			int c = std::max(n, 2 * capacity);
+			for (auto **field : {&x0, &y0, &x1, &y1, &vx, &vy}) {
+				auto *p = allocate(c);
+				if (*field) std::memcpy(p, *field, count * sizeof(float));
+				std::free(*field);
+				*field = p;
+			}
+			capacity = c;
+		}
+		count = n;
+	};
+
+	int size(void) {
+		return count;
+	};
+
+	/*
+     * start a new step, position0 = position1, position1 += velocity * dt
+     */
+	void integrate(int begin, int end, float dt) {
+		int i = begin;
+#if defined(__AVX__)
+		const __m256 t = _mm256_set1_ps(dt);
+		for (; i + 8 <= end; i += 8) {
+			auto px = _mm256_loadu_ps(x1 + i);
+			auto py = _mm256_loadu_ps(y1 + i);
+			_mm256_storeu_ps(x0 + i, px);
+			_mm256_storeu_ps(y0 + i, py);
+			_mm256_storeu_ps(x1 + i, _mm256_add_ps(px, _mm256_mul_ps(_mm256_loadu_ps(vx + i), t)));
+			_mm256_storeu_ps(y1 + i, _mm256_add_ps(py, _mm256_mul_ps(_mm256_loadu_ps(vy + i), t)));
+		}
+#elif defined(__SSE2__)
+		const __m128 t = _mm_set1_ps(dt);
+		for (; i + 4 <= end; i += 4) {
+			auto px = _mm_loadu_ps(x1 + i);
+			auto py = _mm_loadu_ps(y1 + i);
+			_mm_storeu_ps(x0 + i, px);
+			_mm_storeu_ps(y0 + i, py);
+			_mm_storeu_ps(x1 + i, _mm_add_ps(px, _mm_mul_ps(_mm_loadu_ps(vx + i), t)));
+			_mm_storeu_ps(y1 + i, _mm_add_ps(py, _mm_mul_ps(_mm_loadu_ps(vy + i), t)));
+		}
+#endif
+		for (; i < end; i++) {
+			x0[i] = x1[i];
+			y0[i] = y1[i];
+			x1[i] += vx[i] * dt;
+			y1[i] += vy[i] * dt;
+		}
+	};
+
+	/*
+     * largest squared speed of the entities from begin to end
+     */
+	float max_speed2(int begin, int end) {
+		float m = 0.f;
+		for (int i = begin; i < end; i++) {
+			m = std::max(m, vx[i] * vx[i] + vy[i] * vy[i]);
+		}
+		return m;
+	};
+
+	/*
+     * bounce circles of radius r off the walls of a width x height box.
+	 *
+	 * Edges are checked one after another, right, left, bottom and top, an
+	 * entity moved back by one edge is checked against the next edge at
+	 * position0.
+     */
+	void walls(int begin, int end, float r, float width, float height) {
+		bounce(begin, end, width - r, true, x1, vx);
+		bounce(begin, end, r, false, x1, vx);
+		bounce(begin, end, height - r, true, y1, vy);
+		bounce(begin, end, r, false, y1, vy);
+	};
+
+	/*
+     * call func(begin, end) on the pool for every chunk entities and wait
+     */
+	template<class F>
+	void parallel_for(ThreadPool &pool, F func, int chunk = 16384) {
+		for (int begin = 0; begin < count; begin += chunk) {
+			int end = std::min(begin + chunk, count);
+			pool.add([func, begin, end] {
+				func(begin, end);
+			}, "EntitySoA::parallel_for");
+		}
+		pool.wait("EntitySoA::parallel_for");
+	};
+
+	/*
+     * call func(first, last) on the pool for every run of consecutive
+	 * entities in index, which must be ascending, and wait. Runs are split
+	 * into tasks of chunk entries of index.
+     */
+	template<class F>
+	void parallel_for(ThreadPool &pool, const std::vector<int> &index, F func, int chunk = 16384) {
+		int n = index.size();
+		for (int begin = 0; begin < n; begin += chunk) {
+			int end = std::min(begin + chunk, n);
+			pool.add([&index, func, begin, end] {
+				for (int k = begin; k < end;) {
+					int first = index[k];
+					int last = first + 1;
+					for (k++; k < end && index[k] == last; k++) last++;
+
+					func(first, last);
+				}
+			}, "EntitySoA::parallel_for");
+		}
+		pool.wait("EntitySoA::parallel_for");
+	};
+
+	/*
+     * integrate and handle walls of every entity, chunk entities per task
+     */
+	void kinematics(ThreadPool &pool, float dt, float r, float width, float height, int chunk = 16384) {
+		parallel_for(pool, [this, dt, r, width, height](int begin, int end) {
+			integrate(begin, end, dt);
+			walls(begin, end, r, width, height);
+		}, chunk);
+	};
+
+	/*
+     * integrate and handle walls of the entities in index, which must be
+	 * ascending. Runs of consecutive entities use the vector kernels.
+     */
+	void kinematics(ThreadPool &pool, float dt, float r, float width, float height, const std::vector<int> &index, int chunk = 16384) {
+		parallel_for(pool, index, [this, dt, r, width, height](int first, int last) {
+			integrate(first, last, dt);
+			walls(first, last, r, width, height);
+		}, chunk);
+	};
+};
+
+#endif
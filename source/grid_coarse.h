@@ -4,21 +4,25 @@
 #include <mutex>
 #include <array>
 #include <iostream>
+#include <functional>
+#include <cmath>
+
+#include "visited.h"
 
 /*
  * linked list of all items within a bucket
  */
-struct GridNode {
+struct GridNodeC {
 	int eid;
-	GridNode *next;
+	GridNodeC *next;
 };
 
 /*
  * linked list of all buckets within an item
  */
-struct GridReference {
+struct GridReferenceC {
 	int bucket;
-	GridReference *next;
+	GridReferenceC *next;
 };
 
 class GridC {
@@ -26,7 +30,7 @@ class GridC {
 	float cell_size;
 
 	// buckets that coordinates are mapped unto
-	std::array<GridNode*, 100> buckets;
+	std::array<GridNodeC*, 100> buckets;
 
 	std::mutex mtx;
 
@@ -58,7 +62,7 @@ class GridC {
 	 *
  	 * returns a linked list to buckets
      */
-	GridReference* add(int eid, float x1, float y1, float x2, float y2) {
+	GridReferenceC* add(int eid, float x1, float y1, float x2, float y2) {
 		// lock coarse mutex
 		std::lock_guard<std::mutex> lock(mtx);
 
@@ -68,7 +72,7 @@ class GridC {
 		hash_func(row1, col1, x1, y1);
 		hash_func(row2, col2, x2, y2);
 
-		GridReference *ref = nullptr;
+		GridReferenceC *ref = nullptr;
 
 		// insert into every bucket the object touches
 		for (auto i = row1; i <= row2; i++) {
@@ -78,13 +82,13 @@ class GridC {
 				auto &bucket = buckets[hash];
 
 				// insertion
-				auto node = new GridNode();
+				auto node = new GridNodeC();
 				node->eid = eid;
 				node->next = bucket;
 				bucket = node;
 
 				// create reference
-				auto r = new GridReference();
+				auto r = new GridReferenceC();
 				r->bucket = hash;
 				r->next = ref;
 				ref = r;
@@ -99,17 +103,28 @@ class GridC {
 	void clear(void) {
 		for (auto &bucket : buckets) {
 			while (bucket) {
-				auto &node = bucket;
+				auto *node = bucket;
 				bucket = node->next;
 				delete node;
 			}
 		}
 	};
 
+	/*
+     * return reference list to memory
+     */
+	void returnRefNodes(GridReferenceC *ref) {
+		while (ref) {
+			auto *r = ref;
+			ref = ref->next;
+			delete r;
+		}
+	};
+
 	/*
      * query possible collisions from a given eid
      */
-	void query(GridReference *node, int eid) {
+	void query(GridReferenceC *node, int eid) {
 		// for every bucket in reference
 		for (auto *i = node; i; i = i->next) {
 
@@ -124,6 +139,32 @@ class GridC {
 		}
 	};
 
+	/*
+     * report possible collisions from a given eid once, pairs are reported
+	 * from the entity with the lower eid
+     */
+	void query_callback(GridReferenceC *node, int eid, std::function<void(int,int)> func) {
+		// entities already seen from another bucket
+		auto &visited = VisitedSet::local();
+		visited.reset();
+
+		// for every bucket in reference
+		for (auto *i = node; i; i = i->next) {
+
+			// for every node in bucket
+			for (auto *j = buckets[i->bucket]; j; j = j->next) {
+
+				// ignore symmetric collisons and collisions with self
+				if (j->eid <= eid) continue;
+
+				// collision already reported, skip
+				if (!visited.insert(j->eid)) continue;
+
+				func(eid, j->eid);
+			}
+		}
+	};
+
 	/*
      * print the contents of the buckets
      */
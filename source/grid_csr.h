@@ -0,0 +1,206 @@
+#ifndef GRID_CSR
+#define GRID_CSR
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "threadpool.h"
+
+/*
+ * Cell range of an entity added during the current frame.
+ */
+struct GridBox {
+	int eid;
+	int row1, col1;
+	int row2, col2;
+};
+
+/*
+ * Flat grid which is rebuilt from scratch every frame.
+ *
+ * Instead of linked lists the occupants of each bucket are stored
+ * contiguously (compressed sparse rows). A frame goes through three phases:
+ * - add: entities are recorded and the occupants of every bucket counted
+ * - build: prefix sum of the counts, then entities are scattered in parallel
+ * - query: every bucket is a contiguous slice of cell_entities
+ *
+ * Buckets use the same 100 x 100 wrap around as GridLF.
+ */
+class GridCSR {
+	// size of a cell
+	float cell_size;
+
+	// number of entities added this frame
+	std::atomic<int> count;
+
+	// cell ranges of the entities, indexed by handle
+	std::vector<GridBox> boxes;
+
+	// number of occupants per bucket
+	std::array<std::atomic<int>, 10000> cell_count;
+
+	// insertion position per bucket during scatter
+	std::array<std::atomic<int>, 10000> cell_cursor;
+
+	// bucket i owns cell_entities[cell_start[i]] to cell_entities[cell_start[i + 1]]
+	std::array<int, 10001> cell_start;
+
+	// handles of the occupants, grouped by bucket
+	std::vector<int> cell_entities;
+
+	/*
+	 * Hash function which maps x, y coordinates into a bucket.
+	 */
+	void hash_func(int &row, int &col, float x, float y) {
+		col = std::rint((x / cell_size) - 0.5f);
+		row = std::rint((y / cell_size) - 0.5f);
+	};
+
+	/*
+	 * hash integer coordinates to bucket
+	 */
+	int bucket(int row, int col) {
+		return (col % 100) + 100 * (row % 100);
+	};
+
+	/*
+	 * scatter a range of entities into cell_entities
+	 */
+	void scatter(int begin, int end) {
+		for (int h = begin; h < end; h++) {
+			auto &box = boxes[h];
+			for (auto i = box.row1; i <= box.row2; i++) {
+				for (auto j = box.col1; j <= box.col2; j++) {
+					auto pos = cell_cursor[bucket(i, j)].fetch_add(1);
+					cell_entities[pos] = h;
+				}
+			}
+		}
+	};
+
+	public:
+
+	/*
+	 * max_entities is the number of entities that can be added per frame.
+	 */
+	GridCSR(int cs, int max_entities = 102400) {
+		cell_size = cs;
+		count.store(0);
+
+		boxes.resize(max_entities);
+
+		for (auto &c : cell_count) c.store(0);
+		for (auto &c : cell_cursor) c.store(0);
+		cell_start.fill(0);
+	};
+
+	/*
+	 * Record an entity for the next build.
+	 *
+	 * Input is an EntityID and an AABB bounding box representing the object.
+	 * the function assumes x1, y1 is less than x2, y2.
+	 *
+	 * returns a handle used for queries until the grid is cleared
+	 */
+	int add(int eid, float x1, float y1, float x2, float y2) {
+		auto h = count.fetch_add(1);
+
+		// more entities than max_entities in one frame
+		assert(h < (int) boxes.size());
+		auto &box = boxes[h];
+
+		box.eid = eid;
+		hash_func(box.row1, box.col1, x1, y1);
+		hash_func(box.row2, box.col2, x2, y2);
+
+		// count occupants of every bucket the object touches
+		for (auto i = box.row1; i <= box.row2; i++) {
+			for (auto j = box.col1; j <= box.col2; j++) {
+				cell_count[bucket(i, j)].fetch_add(1);
+			}
+		}
+		return h;
+	};
+
+	/*
+	 * Prefix sum the bucket counts and scatter all entities added this
+	 * frame. Must be called after every add and before any query.
+	 */
+	void build(ThreadPool &pool, int chunk = 256) {
+		int total = 0;
+		for (int i = 0; i < (int) cell_count.size(); i++) {
+			cell_start[i] = total;
+			cell_cursor[i].store(total, std::memory_order_relaxed);
+			total += cell_count[i].load(std::memory_order_relaxed);
+		}
+		cell_start[cell_count.size()] = total;
+
+		if ((int) cell_entities.size() < total) cell_entities.resize(total);
+
+		int n = count.load();
+		for (int begin = 0; begin < n; begin += chunk) {
+			int end = std::min(begin + chunk, n);
+			pool.add([this, begin, end] { scatter(begin, end); }, "GridCSR::scatter");
+		}
+		pool.wait("GridCSR::build");
+	};
+
+	/*
+     * Clears the grid after each iteration
+     */
+	void clear(void) {
+		for (auto &c : cell_count) c.store(0, std::memory_order_relaxed);
+		count.store(0);
+	};
+
+	/*
+     * query possible collisions from a given handle
+	 *
+	 * a pair is reported only from the bucket holding the minimum corner of
+	 * the overlap between both cell ranges, so no duplicate list is needed.
+     */
+	void query_callback(int h, std::function<void(int,int)> func) {
+		auto &box = boxes[h];
+
+		for (auto i = box.row1; i <= box.row2; i++) {
+			for (auto j = box.col1; j <= box.col2; j++) {
+				auto b = bucket(i, j);
+
+				for (auto k = cell_start[b]; k < cell_start[b + 1]; k++) {
+					auto &other = boxes[cell_entities[k]];
+
+					// ignore symmetric collisons and collisions with self
+					if (other.eid <= box.eid) continue;
+
+					// only report from the corner of the overlap, this also
+					// skips entities that alias into the bucket from elsewhere
+					if (std::max(box.row1, other.row1) != i) continue;
+					if (std::max(box.col1, other.col1) != j) continue;
+					if (i > other.row2 || j > other.col2) continue;
+
+					func(box.eid, other.eid);
+				}
+			}
+		}
+	};
+
+	/*
+     * print the contents of the buckets
+     */
+	void print(void) {
+		for (int i = 0; i < (int) cell_count.size(); i++) {
+			for (auto k = cell_start[i]; k < cell_start[i + 1]; k++) {
+				std::cout << "bucket " << i;
+				std::cout << " item " << boxes[cell_entities[k]].eid << std::endl;
+			}
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef GRID_FINE
+#define GRID_FINE
+
+#include <atomic>
+#include <array>
+#include <iostream>
+#include <functional>
+#include <cmath>
+
+#include "visited.h"
+
+/*
+ * linked list of all items within a bucket
+ */
+struct GridNodeF {
+	int eid;
+	GridNodeF *next;
+};
+
+/*
+ * linked list of all buckets within an item, every node stores the eid
+ */
+struct GridReferenceF {
+	int eid;
+	int bucket;
+	GridReferenceF *next;
+};
+
+/*
+ * bucket guarded by its own spinlock
+ */
+struct GridBucketF {
+	std::atomic_flag lock;
+	GridNodeF *head;
+};
+
+/*
+ * Grid with one spinlock per bucket. Threads only wait for each other when
+ * they insert into the same bucket at the same time, the lock is held for a
+ * single push.
+ */
+class GridF {
+	// size of a cell
+	float cell_size;
+
+	// buckets that coordinates are mapped unto
+	std::array<GridBucketF, 10000> buckets;
+
+	/*
+	 * Hash function which maps x, y coordinates into a bucket.
+	 * Currently is a 100 x 100 grid which wraps around at the edges.
+	 */
+	void hash_func(int &row, int &col, float x, float y) {
+		col = std::rint((x / cell_size) - 0.5f);
+		row = std::rint((y / cell_size) - 0.5f);
+	};
+
+	public:
+
+	GridF(int cs) {
+		cell_size = cs;
+
+		// initialize buckets
+		for (auto &bucket : buckets) {
+			bucket.lock.clear();
+			bucket.head = nullptr;
+		}
+	};
+
+	/*
+     * Insert references of objects into the grid
+	 *
+	 * Input is an EntityID and an AABB bounding box representing the object.
+	 * the function assumes x1, y1 is less than x2, y2.
+	 *
+ 	 * returns a linked list to buckets
+     */
+	GridReferenceF* add(int eid, float x1, float y1, float x2, float y2) {
+		int row1, col1, row2, col2;
+
+		// hash floating point coordinate into integer coordinates
+		hash_func(row1, col1, x1, y1);
+		hash_func(row2, col2, x2, y2);
+
+		GridReferenceF *ref = nullptr;
+
+		// insert into every bucket the object touches
+		for (auto i = row1; i <= row2; i++) {
+			for (auto j = col1; j <= col2; j++) {
+				// hash integer coordinates to bucket
+				auto hash = (j % 100) + 100 * (i % 100);
+				auto &bucket = buckets[hash];
+
+				auto node = new GridNodeF();
+				node->eid = eid;
+
+				// insertion, only this bucket is locked
+				while (bucket.lock.test_and_set(std::memory_order_acquire));
+				node->next = bucket.head;
+				bucket.head = node;
+				bucket.lock.clear(std::memory_order_release);
+
+				// create reference
+				auto r = new GridReferenceF();
+				r->eid = eid;
+				r->bucket = hash;
+				r->next = ref;
+				ref = r;
+			}
+		}
+		return ref;
+	};
+
+	/*
+     * Clears the grid after each iteration
+     */
+	void clear(void) {
+		for (auto &bucket : buckets) {
+			while (bucket.head) {
+				auto *node = bucket.head;
+				bucket.head = node->next;
+				delete node;
+			}
+		}
+	};
+
+	/*
+     * return reference list to memory
+     */
+	void returnRefNodes(GridReferenceF *ref) {
+		while (ref) {
+			auto *r = ref;
+			ref = ref->next;
+			delete r;
+		}
+	};
+
+	/*
+     * report possible collisions from a given reference once, pairs are
+	 * reported from the entity with the lower eid. Must not run concurrently
+	 * with add.
+     */
+	void query_callback(GridReferenceF *node, std::function<void(int,int)> func) {
+		int eid = node->eid;
+
+		// entities already seen from another bucket
+		auto &visited = VisitedSet::local();
+		visited.reset();
+
+		// for every bucket in reference
+		for (auto *i = node; i; i = i->next) {
+
+			// for every node in bucket
+			for (auto *j = buckets[i->bucket].head; j; j = j->next) {
+
+				// ignore symmetric collisons and collisions with self
+				if (j->eid <= eid) continue;
+
+				// collision already reported, skip
+				if (!visited.insert(j->eid)) continue;
+
+				func(eid, j->eid);
+			}
+		}
+	};
+
+	/*
+     * print the contents of the buckets
+     */
+	void print(void) {
+		for (int i = 0; i < (int) buckets.size(); i++) {
+			for (auto *node = buckets[i].head; node; node = node->next) {
+				std::cout << "bucket " << i;
+				std::cout << " item " << node->eid << std::endl;
+			}
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,462 @@
+#ifndef GRID_HASH
+#define GRID_HASH
+
+#include <atomic>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include "visited.h"
+#include "arena.h"
+
+/*
+ * entity stored in a cell
+ */
+struct GridHashNode {
+	int eid;
+	GridHashNode *next;
+};
+
+/*
+ * occupied cell, key packs the column and row of the cell
+ */
+struct GridHashCell {
+	uint64_t key;
+	std::atomic<GridHashNode*> head;
+};
+
+/*
+ * linked list of all cells within an entity, every node stores the eid
+ */
+struct GridHashRef {
+	int eid;
+	GridHashCell *cell;
+	GridHashRef *next;
+};
+
+// lowest bit of a slot, set when a resize has moved the slot
+const uintptr_t GRID_HASH_FROZEN = 1;
+
+// slots moved by a thread at once during a resize
+const int GRID_HASH_CHUNK = 256;
+
+// smallest table
+const int GRID_HASH_MIN = 1024;
+
+/*
+ * Open addressing table of cells with linear probing.
+ *
+ * A slot holds a cell pointer. Cells are never removed within a frame, so
+ * a probe ends at the first empty slot. A resize freezes every slot by
+ * setting its lowest bit, cells are then added to the next table.
+ */
+struct GridHashTable {
+	int capacity;
+	std::vector<std::atomic<uintptr_t>> slots;
+
+	// number of cells in the table
+	std::atomic<int> count;
+
+	// larger table the cells are moved to, null if not resizing
+	std::atomic<GridHashTable*> next;
+
+	// chunks of slots claimed and finished by resizing threads
+	std::atomic<int> claimed;
+	std::vector<std::atomic<bool>> moved;
+
+	GridHashTable(int c) : slots(c), moved((c + GRID_HASH_CHUNK - 1) / GRID_HASH_CHUNK) {
+		capacity = c;
+		reset();
+	};
+
+	void reset(void) {
+		for (auto &slot : slots) slot.store(0);
+		for (auto &chunk : moved) chunk.store(false);
+		count.store(0);
+		next.store(nullptr);
+		claimed.store(0);
+	};
+};
+
+/*
+ * Grid whose cells are stored in a lock-free hash map keyed by the packed
+ * column and row of a cell.
+ *
+ * Unlike GridLF, cells far apart never share a bucket, and memory grows with
+ * the number of occupied cells instead of the size of the world. Entities
+ * are added concurrently, the table grows when it is half full. Threads
+ * which run into a resize help move the slots, in chunks, and finish
+ * chunks of stalled threads, so a resize never waits for another thread.
+ */
+class GridHashLF {
+	// size of a cell
+	float cell_size;
+
+	// table new cells are added to
+	std::atomic<GridHashTable*> current;
+
+	// first table of the frame, tables left behind by a resize are
+	// deleted by clear
+	GridHashTable *oldest;
+
+	BumpArena<GridHashNode> nodes;
+	BumpArena<GridHashCell> cells;
+	BumpArena<GridHashRef> refs;
+
+	/*
+	 * column and row of the cell containing x, y
+	 */
+	void cell_func(int &row, int &col, float x, float y) {
+		col = std::floor(x / cell_size);
+		row = std::floor(y / cell_size);
+	};
+
+	uint64_t pack(int row, int col) {
+		return ((uint64_t) (uint32_t) col << 32) | (uint32_t) row;
+	};
+
+	/*
+	 * spread the bits of a key over the whole word
+	 */
+	uint64_t mix(uint64_t key) {
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ULL;
+		key ^= key >> 33;
+		return key;
+	};
+
+	/*
+     * start resizing a table
+     */
+	void grow(GridHashTable *table) {
+		if (table->next.load()) return;
+
+		auto *next = new GridHashTable(table->capacity * 2);
+		GridHashTable *expected = nullptr;
+		bool s = table->next.compare_exchange_strong(expected, next);
+		if (!s) delete next;
+	};
+
+	/*
+     * find the cell of a key in a table or add cell, which is allocated
+	 * when null.
+	 *
+	 * returns nullptr if the table is being resized
+     */
+	GridHashCell* insertInto(GridHashTable *table, uint64_t key, GridHashCell *&cell) {
+		int mask = table->capacity - 1;
+		int i = mix(key) & mask;
+
+		for (int probe = 0; probe < table->capacity;) {
+			auto &slot = table->slots[i];
+			auto v = slot.load();
+
+			if (v & GRID_HASH_FROZEN) return nullptr;
+
+			if (v == 0) {
+				if (!cell) {
+					cell = cells.allocate();
+					cell->key = key;
+					cell->head.store(nullptr);
+				}
+
+				bool s = slot.compare_exchange_strong(v, (uintptr_t) cell);
+
+				// slot changed, look at it again
+				if (!s) continue;
+
+				// half full, resize before returning
+				if (table->count.fetch_add(1) + 1 > table->capacity / 2) {
+					grow(table);
+					migrate(table);
+				}
+				return cell;
+			}
+
+			auto *c = (GridHashCell*) v;
+			if (c->key == key) return c;
+
+			i = (i + 1) & mask;
+			probe++;
+		}
+
+		// every slot is taken
+		grow(table);
+		return nullptr;
+	};
+
+	/*
+     * find or add the cell of a key
+     */
+	GridHashCell* insert(uint64_t key) {
+		GridHashCell *cell = nullptr;
+		auto *table = current.load();
+		while (true) {
+			auto *found = insertInto(table, key, cell);
+			if (found) return found;
+
+			// table is being resized, help and move on
+			migrate(table);
+			table = table->next.load();
+		}
+	};
+
+	/*
+     * freeze a chunk of slots and copy their cells into the next table.
+	 * Copying is idempotent, a chunk may be moved by several threads.
+     */
+	void moveChunk(GridHashTable *table, int chunk) {
+		int begin = chunk * GRID_HASH_CHUNK;
+		int end = std::min(begin + GRID_HASH_CHUNK, table->capacity);
+
+		for (int i = begin; i < end; i++) {
+			auto &slot = table->slots[i];
+			auto v = slot.load();
+			while (!(v & GRID_HASH_FROZEN)) {
+				bool s = slot.compare_exchange_weak(v, v | GRID_HASH_FROZEN);
+				if (s) v |= GRID_HASH_FROZEN;
+			}
+
+			auto *cell = (GridHashCell*) (v & ~GRID_HASH_FROZEN);
+			if (!cell) continue;
+
+			auto *next = table->next.load();
+			while (!insertInto(next, cell->key, cell)) {
+				migrate(next);
+				next = next->next.load();
+			}
+		}
+		table->moved[chunk].store(true);
+	};
+
+	/*
+     * move every cell of a table being resized into the next table
+     */
+	void migrate(GridHashTable *table) {
+		int chunks = table->moved.size();
+
+		// claim chunks no other thread has claimed
+		while (true) {
+			int chunk = table->claimed.fetch_add(1);
+			if (chunk >= chunks) break;
+			moveChunk(table, chunk);
+		}
+
+		// finish chunks of threads which have not finished yet
+		for (int chunk = 0; chunk < chunks; chunk++) {
+			if (!table->moved[chunk].load()) moveChunk(table, chunk);
+		}
+
+		// new cells go to the next table from now on
+		auto *expected = table;
+		current.compare_exchange_strong(expected, table->next.load());
+	};
+
+	/*
+     * cell of a key, nullptr if no entity is stored in it
+     */
+	GridHashCell* find(uint64_t key) {
+		for (auto *table = current.load(); table; table = table->next.load()) {
+			int mask = table->capacity - 1;
+			int i = mix(key) & mask;
+
+			for (int probe = 0; probe < table->capacity; probe++) {
+				auto v = table->slots[i].load();
+
+				// key is not in this table
+				if (v == 0) return nullptr;
+				if (v == GRID_HASH_FROZEN) break;
+
+				auto *cell = (GridHashCell*) (v & ~GRID_HASH_FROZEN);
+				if (cell->key == key) return cell;
+
+				i = (i + 1) & mask;
+			}
+		}
+		return nullptr;
+	};
+
+	public:
+
+	GridHashLF(float cs) {
+		cell_size = cs;
+		oldest = new GridHashTable(GRID_HASH_MIN);
+		current.store(oldest);
+	};
+
+	~GridHashLF() {
+		while (oldest) {
+			auto *next = oldest->next.load();
+			delete oldest;
+			oldest = next;
+		}
+	};
+
+	/*
+     * Insert references of objects into the grid
+	 *
+	 * Input is an EntityID and an AABB bounding box representing the object.
+	 * the function assumes x1, y1 is less than x2, y2.
+	 *
+ 	 * returns a linked list to cells
+     */
+	GridHashRef* add(int eid, float x1, float y1, float x2, float y2) {
+		int row1, col1, row2, col2;
+
+		// map floating point coordinate into integer coordinates
+		cell_func(row1, col1, x1, y1);
+		cell_func(row2, col2, x2, y2);
+
+		GridHashRef *ref = nullptr;
+
+		// insert into every cell the object touches
+		for (auto i = row1; i <= row2; i++) {
+			for (auto j = col1; j <= col2; j++) {
+				auto *cell = insert(pack(i, j));
+
+				// insert object into cell
+				auto *node = nodes.allocate();
+				node->eid = eid;
+				while (true) {
+					auto *old_head = cell->head.load();
+					node->next = old_head;
+					bool s = cell->head.compare_exchange_strong(old_head, node);
+					if (s) break;
+				}
+
+				// add cell to reference list
+				auto *r = refs.allocate();
+				r->eid = eid;
+				r->cell = cell;
+				r->next = ref;
+				ref = r;
+			}
+		}
+		return ref;
+	};
+
+	/*
+     * Clears the grid after each iteration, every reference list returned
+	 * by add becomes invalid. The table is shrunk when less than an eighth
+	 * of it was used. Must not run concurrently with any other operation.
+     */
+	void clear(void) {
+		auto *table = current.load();
+		while (table->next.load()) table = table->next.load();
+
+		// delete tables left behind by resizes
+		while (oldest != table) {
+			auto *next = oldest->next.load();
+			delete oldest;
+			oldest = next;
+		}
+
+		if (table->capacity > GRID_HASH_MIN && table->count.load() * 8 < table->capacity) {
+			int capacity = table->capacity / 2;
+			delete table;
+			table = new GridHashTable(capacity);
+		} else {
+			table->reset();
+		}
+		oldest = table;
+		current.store(table);
+
+		nodes.reset();
+		cells.reset();
+		refs.reset();
+	};
+
+	/*
+     * reference nodes come from an arena which clear() frees as a whole,
+	 * kept so GridHashLF can be used in place of the other grids
+     */
+	void returnRefNodes(GridHashRef *) {
+	};
+
+	/*
+     * query possible collisions from a given reference list
+     */
+	void query_callback(GridHashRef *ref, std::function<void(int,int)> func) {
+		int eid = ref->eid;
+
+		// entities already seen from another cell
+		auto &visited = VisitedSet::local();
+		visited.reset();
+
+		// for every cell in reference
+		for (auto *i = ref; i; i = i->next) {
+
+			// for every node in cell
+			for (auto *j = i->cell->head.load(); j; j = j->next) {
+
+				// ignore symmetric collisons and collisions with self
+				if (j->eid <= eid) continue;
+
+				// collision already reported, skip
+				if (!visited.insert(j->eid)) continue;
+
+				func(eid, j->eid);
+			}
+		}
+	};
+
+	/*
+     * query every entity in the cells covering an AABB other than eid,
+	 * the AABB does not need to be inserted into the grid
+     */
+	void query_region(int eid, float x1, float y1, float x2, float y2, std::function<void(int,int)> func) {
+		int row1, col1, row2, col2;
+		cell_func(row1, col1, x1, y1);
+		cell_func(row2, col2, x2, y2);
+
+		auto &visited = VisitedSet::local();
+		visited.reset();
+
+		for (auto i = row1; i <= row2; i++) {
+			for (auto j = col1; j <= col2; j++) {
+				auto *cell = find(pack(i, j));
+				if (!cell) continue;
+
+				for (auto *k = cell->head.load(); k; k = k->next) {
+					if (k->eid == eid) continue;
+					if (!visited.insert(k->eid)) continue;
+					func(eid, k->eid);
+				}
+			}
+		}
+	};
+
+	/*
+     * number of occupied cells and slots of the table
+     */
+	void stats(int &occupied, int &capacity) {
+		auto *table = current.load();
+		occupied = table->count.load();
+		capacity = table->capacity;
+	};
+
+	/*
+     * print the contents of the cells
+     */
+	void print(void) {
+		auto *table = current.load();
+		for (auto &slot : table->slots) {
+			auto *cell = (GridHashCell*) (slot.load() & ~GRID_HASH_FROZEN);
+			if (!cell) continue;
+
+			int col = cell->key >> 32;
+			int row = cell->key & 0x00000000FFFFFFFF;
+			for (auto *node = cell->head.load(); node; node = node->next) {
+				std::cout << "cell " << col << " " << row;
+				std::cout << " item " << node->eid << std::endl;
+			}
+		}
+	};
+};
+
+#endif
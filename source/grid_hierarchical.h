@@ -0,0 +1,125 @@
+#ifndef GRID_HIERARCHICAL
+#define GRID_HIERARCHICAL
+
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+
+#include "grid_lockfree.h"
+
+/*
+ * reference of an entity in the hierarchical grid
+ */
+struct GridHRef {
+	// level the entity was inserted into
+	int level;
+
+	// AABB of the entity, used to look it up on coarser levels
+	float x1, y1;
+	float x2, y2;
+
+	// reference list within the level
+	GridNode *ref;
+};
+
+/*
+ * Stack of lock-free grids with growing cell sizes.
+ *
+ * Every entity goes into the finest level whose cells are at least as large
+ * as its AABB, so it touches at most 2 x 2 buckets of that level. Entities
+ * larger than the cells of the coarsest level go onto the coarsest level and
+ * cover as many of its buckets as they span.
+ * An entity finds its partners on its own level and on every coarser level.
+ * Partners on finer levels find it instead, so each pair is reported once.
+ */
+class GridH {
+	// cell size of every level, finest first. GridLF only takes integer
+	// cell sizes, so the sizes and the ratio between levels are integers.
+	std::vector<int> cell_sizes;
+
+	std::vector<GridLF*> levels;
+
+	public:
+
+	/*
+	 * cs is the cell size of the finest level, each level is ratio times
+	 * coarser than the previous one.
+	 */
+	GridH(int cs, int num_levels = 4, int ratio = 4) {
+		for (int i = 0; i < num_levels; i++) {
+			cell_sizes.push_back(cs);
+			levels.push_back(new GridLF(cs));
+			cs *= ratio;
+		}
+	};
+
+	~GridH() {
+		for (auto *level : levels) delete level;
+	};
+
+	GridH(const GridH&) = delete;
+	GridH& operator=(const GridH&) = delete;
+
+	/*
+     * Insert an entity into the level matching its size.
+	 *
+	 * the function assumes x1, y1 is less than x2, y2.
+     */
+	GridHRef add(int eid, float x1, float y1, float x2, float y2) {
+		auto size = std::max(x2 - x1, y2 - y1);
+
+		// finest level which fits the object, largest objects go on top
+		int level = 0;
+		while (level < (int) levels.size() - 1 && cell_sizes[level] < size) level++;
+
+		GridHRef ref;
+		ref.level = level;
+		ref.x1 = x1;
+		ref.y1 = y1;
+		ref.x2 = x2;
+		ref.y2 = y2;
+		ref.ref = levels[level]->add(eid, x1, y1, x2, y2);
+		return ref;
+	};
+
+	/*
+     * Clears the grid after each iteration
+     */
+	void clear(void) {
+		for (auto *level : levels) level->clear();
+	};
+
+	/*
+     * return reference list to memory
+     */
+	void returnRefNodes(GridHRef &ref) {
+		levels[ref.level]->returnRefNodes(ref.ref);
+	};
+
+	/*
+     * query possible collisions from a given reference
+     */
+	void query_callback(GridHRef &ref, std::function<void(int,int)> func) {
+		// own level, symmetric pairs are removed by eid
+		levels[ref.level]->query_callback(ref.ref, func);
+
+		// coarser levels, the finer entity reports the pair
+		int eid = ref.ref->data.load(std::memory_order_relaxed);
+		for (int i = ref.level + 1; i < (int) levels.size(); i++) {
+			levels[i]->query_region(eid, ref.x1, ref.y1, ref.x2, ref.y2, func);
+		}
+	};
+
+	/*
+     * print the contents of every level
+     */
+	void print(void) {
+		for (int i = 0; i < (int) levels.size(); i++) {
+			std::cout << "level " << i << " cell size " << cell_sizes[i] << std::endl;
+			levels[i]->print();
+		}
+	};
+};
+
+#endif
@@ -6,6 +6,15 @@
 #include <iostream>
 #include <limits>
 #include <thread>
+#include <functional>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include "visited.h"
+#include "threadslot.h"
+#include "threadpool.h"
 
 /*
  * linked list of all items within a bucket
@@ -15,24 +24,134 @@
  * GridReference has been merged with GridNode
  */
 struct GridNode {
-	int data;
+	// written by move and remove while other threads query, so it is
+	// atomic. Relaxed is enough, the node is published by the CAS on the
+	// bucket.
+	std::atomic<int> data;
 	GridNode *next;
 };
 
+/*
+ * data of a bucket node whose entity has moved away. Queries skip it
+ * until purge unlinks it.
+ */
+const int GRID_TOMBSTONE = std::numeric_limits<int>::lowest();
+
+/*
+ * handle of an entity added to a single cell with add_center
+ */
+struct GridCell {
+	int eid;
+	int hash;
+};
+
+/*
+ * ray from ox, oy along dx, dy. Points on the ray are o + t * d for t from
+ * 0 to max_t, d does not need to be normalized.
+ */
+struct GridRay {
+	float ox, oy;
+	float dx, dy;
+	float max_t;
+};
+
+/*
+ * closest entity hit by a ray, eid is -1 if nothing was hit
+ */
+struct GridRayHit {
+	int eid;
+	float t;
+};
+
+/*
+ * point of interest of a radius or nearest neighbor query. r is the radius,
+ * or the largest distance of a neighbor.
+ */
+struct GridProbe {
+	float x, y;
+	float r;
+};
+
+/*
+ * entity found by a nearest neighbor query, eid is -1 if there are fewer
+ * than k neighbors
+ */
+struct GridNeighbor {
+	int eid;
+	float d;
+};
+
+/*
+ * most cells a ray walks, so rays without a finite max_t end
+ */
+const int GRID_RAY_CELLS = 1 << 20;
+
+/*
+ * number of nodes a thread takes from the pool at once
+ */
+const int GRID_ARENA_BLOCK = 256;
+
+/*
+ * per thread allocation state, padded to a cache line so threads never
+ * write to the same line
+ */
+struct alignas(64) GridArena {
+	// block of nodes owned by the thread, next == end when used up
+	int next;
+	int end;
+
+	// nodes allocated and freed by the thread
+	long alloc;
+	long freed;
+};
+
+/*
+ * Nodes are allocated in one of two ways, chosen when the grid is created.
+ *
+ * By default the grid is rebuilt every frame. Every thread bumps through its
+ * own block of the nodepool, and clear resets all blocks at once, so add
+ * never touches a shared free list and nodes are never freed one by one.
+ *
+ * A persistent grid is kept between frames with move and purge. Its nodes
+ * are freed one by one into a free list tagged with a counter, the same as
+ * TaskRef, so a node freed and reallocated during a CAS is not mistaken for
+ * the old head.
+ */
 class GridLF {
 	// size of a cell
 	float cell_size;
 
+	// nodes are kept between frames
+	bool persistent;
+
+	// allocation state of every thread
+	std::array<GridArena, MAX_THREAD_SLOTS> arenas;
 
-	std::atomic<int> alloc;
-	std::atomic<int> freed;
+	// start of the unused part of the nodepool
+	std::atomic<int> bump;
+
+	// number of tombstones waiting for purge
+	std::atomic<int> dead;
 
 	// buckets that coordinates are mapped unto
-	std::array<GridNode*, 10000> buckets;
+	std::array<std::atomic<GridNode*>, 10000> buckets;
+
+	// buckets which became non empty since the last clear, clear only
+	// visits these. A bucket is only recorded once per frame because
+	// buckets of a grid which is not persistent are never emptied.
+	std::array<int, 10000> dirty;
+	std::atomic<int> num_dirty;
 
 
+	// Warning - Make sure there are enough nodes. A grid which runs out of
+	// nodes waits for nodes which are only returned by clear or purge.
 	std::array<GridNode, 204800> nodepool;
-	std::atomic<GridNode*> free;
+
+	// head of the free list of a persistent grid
+	// - 32 bit counter
+	// - 32 bit index, index 0 is reserved for null
+	// data of a free node is the index of the next free node
+	std::atomic<uint64_t> free;
 
 	/*
 	 * Hash function which maps x, y coordinates into a bucket.
@@ -44,16 +163,24 @@ class GridLF {
 	};
 
 	/*
-     * return a node to the freelist
+     * return a node to the freelist, nodes of a grid which is not
+	 * persistent are returned by clear
      */
 	void freeNode(GridNode *node) {
+		if (!persistent) return;
+
+		uint32_t index = node - nodepool.data() + 1;
 		while (true) {
-			auto old_free = free.load();
-			node->next = old_free;
-			bool s = free.compare_exchange_strong(old_free, node);
+			auto ref = free.load();
+			node->data.store(ref & 0x00000000FFFFFFFF, std::memory_order_relaxed);
+
+			auto counter = ref >> 32;
+			uint64_t new_ref = ((counter + 1) << 32) | index;
+
+			bool s = free.compare_exchange_strong(ref, new_ref);
 			if (s) break;
 		}
-		freed.fetch_add(1);
+		arenas[thread_slot()].freed++;
 	};
 
 	/*
@@ -68,60 +195,363 @@ class GridLF {
 	};
 
 	/*
-     * allocate a node from the free list
+     * pop a node from the free list
      */
-	GridNode* allocateNode(void) {
+	GridNode* popNode(void) {
 		while (true) {
-			auto old_free = free.load();
+			auto ref = free.load();
+			uint32_t index = ref & 0x00000000FFFFFFFF;
 
 			// list is empty, try again later
-			if (old_free == nullptr) continue;
+			if (index == 0) continue;
+
+			auto counter = ref >> 32;
+			uint64_t new_ref = ((counter + 1) << 32) | (uint32_t) nodepool[index - 1].data.load(std::memory_order_relaxed);
+
+			bool s = free.compare_exchange_strong(ref, new_ref);
+			if (s) return &nodepool[index - 1];
+		}
+	};
+
+	/*
+     * take the next node of the block owned by the calling thread
+     */
+	GridNode* bumpNode(GridArena &arena) {
+		if (arena.next == arena.end) {
+			// take a new block from the unused part of the nodepool
+			while (true) {
+				int start = bump.load();
+
+				// pool is used up, try again later
+				if (start >= (int) nodepool.size()) continue;
+
+				int end = std::min(start + GRID_ARENA_BLOCK, (int) nodepool.size());
+				bool s = bump.compare_exchange_strong(start, end);
+				if (s) {
+					arena.next = start;
+					arena.end = end;
+					break;
+				}
+			}
+		}
+		return &nodepool[arena.next++];
+	};
+
+	/*
+     * allocate a node
+     */
+	GridNode* allocateNode(void) {
+		auto &arena = arenas[thread_slot()];
+		auto *node = persistent ? popNode() : bumpNode(arena);
+		arena.alloc++;
+
+		node->data.store(0, std::memory_order_relaxed);
+		node->next = nullptr;
+		return node;
+	};
+
+	/*
+     * clear scans every bucket instead of the dirty list. Dirty buckets are
+	 * in random order, once most buckets are dirty a sequential scan is
+	 * faster.
+     */
+	bool scanAll(void) {
+		return persistent || num_dirty.load() > (int) buckets.size() / 2;
+	};
+
+	/*
+     * walk the cells of a ray with a 2D DDA, see raycast
+     */
+	GridRayHit castRay(const GridRay &ray, std::function<float(int)> &sink, bool first_hit) {
+		GridRayHit hit = {-1, std::numeric_limits<float>::infinity()};
+		const float inf = std::numeric_limits<float>::infinity();
+
+		// negative cells hold nothing, start where the ray enters the
+		// quadrant of positive coordinates
+		float t0 = 0.0f;
+		if (ray.ox < 0) {
+			if (ray.dx <= 0) return hit;
+			t0 = std::max(t0, -ray.ox / ray.dx);
+		}
+		if (ray.oy < 0) {
+			if (ray.dy <= 0) return hit;
+			t0 = std::max(t0, -ray.oy / ray.dy);
+		}
+		if (t0 > ray.max_t) return hit;
+
+		// the cell is hashed like the entities are, boundaries below are
+		// computed from it so they agree even where rint rounds a point on
+		// a boundary into the lower cell
+		int row, col;
+		hash_func(row, col, std::max(ray.ox + t0 * ray.dx, 0.f), std::max(ray.oy + t0 * ray.dy, 0.f));
+
+		// direction of a step and t between cell boundaries
+		int step_col = ray.dx > 0 ? 1 : -1;
+		int step_row = ray.dy > 0 ? 1 : -1;
+		float delta_col = ray.dx != 0 ? cell_size / std::fabs(ray.dx) : inf;
+		float delta_row = ray.dy != 0 ? cell_size / std::fabs(ray.dy) : inf;
+
+		// t of the next column and row boundary
+		float next_col = inf;
+		float next_row = inf;
+		if (ray.dx != 0) next_col = ((col + (ray.dx > 0)) * cell_size - ray.ox) / ray.dx;
+		if (ray.dy != 0) next_row = ((row + (ray.dy > 0)) * cell_size - ray.oy) / ray.dy;
+
+		// entities already tested from another cell
+		auto &visited = VisitedSet::local();
+		visited.reset();
+
+		// the hash does not map negative cells, nothing is stored there
+		for (int cells = 0; row >= 0 && col >= 0 && cells < GRID_RAY_CELLS; cells++) {
+			auto hash = (col % 100) + 100 * (row % 100);
+
+			for (auto *node = buckets[hash].load(); node; node = node->next) {
+				int eid = node->data.load(std::memory_order_relaxed);
+				if (eid == GRID_TOMBSTONE) continue;
+				if (!visited.insert(eid)) continue;
+
+				auto t = sink(eid);
+				if (t < 0 || t > ray.max_t || t >= hit.t) continue;
+				hit.eid = eid;
+				hit.t = t;
+			}
+
+			// hits in later cells can not be closer
+			auto exit_t = std::min(next_col, next_row);
+			if (first_hit && hit.eid >= 0 && hit.t <= exit_t) break;
+			if (exit_t > ray.max_t) break;
+
+			if (next_col < next_row) {
+				col += step_col;
+				next_col += delta_col;
+			} else {
+				row += step_row;
+				next_row += delta_row;
+			}
+		}
+		return hit;
+	};
+
+	/*
+     * distance from a point to the nearest point of a cell
+     */
+	float cellDistance(float x, float y, int row, int col) {
+		auto dx = std::max(std::max(col * cell_size - x, x - (col + 1) * cell_size), 0.f);
+		auto dy = std::max(std::max(row * cell_size - y, y - (row + 1) * cell_size), 0.f);
+		return std::sqrt(dx * dx + dy * dy);
+	};
+
+	/*
+     * call func with every cell n rows or columns away from row0, col0
+     */
+	template<class F>
+	void visitRing(int row0, int col0, int n, F func) {
+		if (n == 0) {
+			func(row0, col0);
+			return;
+		}
+		for (auto j = col0 - n; j <= col0 + n; j++) {
+			func(row0 - n, j);
+			func(row0 + n, j);
+		}
+		for (auto i = row0 - n + 1; i < row0 + n; i++) {
+			func(i, col0 - n);
+			func(i, col0 + n);
+		}
+	};
 
-			auto new_free = old_free->next;
-			bool s = free.compare_exchange_strong(old_free, new_free);
+	/*
+     * call func with every entity of a cell which was not visited yet
+     */
+	template<class F>
+	void visitCell(int row, int col, VisitedSet &visited, F func) {
+		// the hash does not map negative cells, nothing is stored there
+		if (row < 0 || col < 0) return;
+
+		auto hash = (col % 100) + 100 * (row % 100);
+		for (auto *node = buckets[hash].load(); node; node = node->next) {
+			int eid = node->data.load(std::memory_order_relaxed);
+			if (eid == GRID_TOMBSTONE) continue;
+			if (!visited.insert(eid)) continue;
+			func(eid);
+		}
+	};
+
+	/*
+     * see query_radius
+     */
+	void radiusQuery(const GridProbe &probe, std::function<void(int)> &sink) {
+		int row, col;
+		hash_func(row, col, probe.x, probe.y);
+
+		auto &visited = VisitedSet::local();
+		visited.reset();
+
+		// the grid wraps around after 100 cells, more rings see no new buckets.
+		// Clamped as a float, an infinite radius does not fit an int.
+		int rings = std::fmin(std::ceil(probe.r / cell_size) + 1, 99.0f);
+		for (int n = 0; n <= rings; n++) {
+			visitRing(row, col, n, [&](int i, int j) {
+				if (cellDistance(probe.x, probe.y, i, j) > probe.r) return;
+				visitCell(i, j, visited, [&](int eid) { sink(eid); });
+			});
+		}
+	};
+
+	/*
+     * see query_knn, found is a max heap on distance while searching
+     */
+	void knnQuery(const GridProbe &probe, int k, std::function<float(int)> &dist, std::vector<GridNeighbor> &found) {
+		found.clear();
+		if (k <= 0) return;
+
+		auto farther = [](const GridNeighbor &a, const GridNeighbor &b) { return a.d < b.d; };
+
+		int row, col;
+		hash_func(row, col, probe.x, probe.y);
+
+		// distance from the point to the edge of its own cell
+		auto fx = probe.x - col * cell_size;
+		auto fy = probe.y - row * cell_size;
+		auto edge = std::max(std::min(std::min(fx, cell_size - fx), std::min(fy, cell_size - fy)), 0.f);
+
+		auto &visited = VisitedSet::local();
+		visited.reset();
+
+		for (int n = 0; n < 100; n++) {
+			visitRing(row, col, n, [&](int i, int j) {
+				// cell can not hold anything closer than what was found
+				auto bound = (int) found.size() == k ? found.front().d : probe.r;
+				if (cellDistance(probe.x, probe.y, i, j) > bound) return;
+
+				visitCell(i, j, visited, [&](int eid) {
+					auto d = dist(eid);
+					if (d > probe.r) return;
+					if ((int) found.size() == k) {
+						if (d >= found.front().d) return;
+						std::pop_heap(found.begin(), found.end(), farther);
+						found.pop_back();
+					}
+					found.push_back({eid, d});
+					std::push_heap(found.begin(), found.end(), farther);
+				});
+			});
+
+			// every unvisited cell is at least this far away
+			auto next = n * cell_size + edge;
+			if (next > probe.r) break;
+			if ((int) found.size() == k && found.front().d <= next) break;
+		}
+		std::sort_heap(found.begin(), found.end(), farther);
+	};
+
+	/*
+     * reset the allocation state, every node becomes unused
+     */
+	void resetNodes(void) {
+		for (auto &arena : arenas) {
+			arena.next = 0;
+			arena.end = 0;
+			arena.freed = arena.alloc;
+		}
+		bump.store(0);
+
+		if (!persistent) return;
+
+		// chain every node into the free list
+		for (int i = 0; i < (int) nodepool.size(); i++) {
+			nodepool[i].data.store(i + 1 < (int) nodepool.size() ? i + 2 : 0, std::memory_order_relaxed);
+		}
+		free.store(nodepool.empty() ? 0 : 1);
+	};
+
+	/*
+     * push a node onto the front of a bucket
+     */
+	void pushNode(int hash, GridNode *node) {
+		auto &bucket = buckets[hash];
+		while (true) {
+			auto old_head = bucket.load();
+			node->next = old_head;
+			bool s = bucket.compare_exchange_strong(old_head, node);
 			if (s) {
-				alloc.fetch_add(1);
-				old_free->data = 0;
-				old_free->next = nullptr;
-				return old_free;
+				if (!old_head && !persistent) dirty[num_dirty.fetch_add(1)] = hash;
+				break;
 			}
 		}
 	};
 
 	/*
-	 * create sentinel nodes for linked lists
-	 */
-	GridNode* build_sentinels(void) {
-		auto *min = allocateNode();
-		auto *max = allocateNode();
+     * insert eid into every bucket from row1, col1 to row2, col2
+	 *
+ 	 * returns the reference list of buckets, last bucket first
+     */
+	GridNode* insertCells(int eid, int row1, int col1, int row2, int col2) {
+		// reference list
+		GridNode *ref = nullptr;
 
-		min->data = std::numeric_limits<int>::lowest();
-		max->data = std::numeric_limits<int>::max();
+		// insert into every bucket the object touches
+		for (auto i = row1; i <= row2; i++) {
+			for (auto j = col1; j <= col2; j++) {
+				// hash integer coordinates to bucket
+				auto hash = (j % 100) + 100 * (i % 100);
+
+				// insert object into bucket
+				auto node = allocateNode();
+				node->data.store(eid, std::memory_order_relaxed);
+				pushNode(hash, node);
+
+				// add bucket to reference list
+				auto r = allocateNode();
+				r->data.store(hash, std::memory_order_relaxed);
+				r->next = ref;
+				ref = r;
+			}
+		}
+		return ref;
+	};
 
-		min->next = max;
-		max->next = nullptr;
-		return min;
-	}
+	/*
+     * mark the bucket nodes of an entity as tombstones, purge unlinks them
+     */
+	void tombstone(GridNode *id) {
+		int eid = id->data.load(std::memory_order_relaxed);
+		for (auto *r = id->next; r; r = r->next) {
+			for (auto *j = buckets[r->data.load(std::memory_order_relaxed)].load(); j; j = j->next) {
+				if (j->data.load(std::memory_order_relaxed) != eid) continue;
+				j->data.store(GRID_TOMBSTONE, std::memory_order_relaxed);
+				break;
+			}
+		}
+		dead.fetch_add(1);
+	};
 
 	public:
 
-	GridLF(int cs) {
+	/*
+	 * cs is the size of a cell. A persistent grid is kept between frames
+	 * with move and purge, any other grid is rebuilt every frame with add
+	 * and clear.
+	 */
+	GridLF(int cs, bool p = false) {
 		cell_size = cs;
+		persistent = p;
 
-		free.store(0);
+		dead.store(0);
+		num_dirty.store(0);
 
-		alloc.store(0);
-		freed.store(0);
+		for (auto &arena : arenas) {
+			arena.alloc = 0;
+			arena.freed = 0;
+		}
 
 		// initialize buckets
 		for (auto &bucket : buckets) {
-			bucket = nullptr;
+			bucket.store(nullptr);
 		}
 
-		// initialize freelist
-		for (auto &node : nodepool) {
-			freeNode(&node);
-		}
+		// initialize nodes
+		resetNodes();
 	};
 
 	/*
@@ -142,141 +572,425 @@ class GridLF {
 		// reference list of buckets
 		// first node stores eid
 		GridNode *id = allocateNode();
-		id->data = eid;
+		id->data.store(eid, std::memory_order_relaxed);
 
-		// reference list
-		GridNode *ref = nullptr;
+		// make id node first
+		id->next = insertCells(eid, row1, col1, row2, col2);
+		return id;
+	};
 
-		// insert into every bucket the object touches
-		for (auto i = row1; i <= row2; i++) {
-			for (auto j = col1; j <= col2; j++) {
-				// hash integer coordinates to bucket
-				auto hash = (j % 100) + 100 * (i % 100);
-				auto &bucket = buckets[hash];
+	/*
+     * Insert an entity into the one cell containing the center of its AABB.
+	 *
+	 * Used for entities no larger than a cell, which can only overlap
+	 * entities in the 3 x 3 cells around their own. Takes a single node
+	 * instead of a reference list and a node per cell covered.
+	 *
+	 * returns a handle for query_cell
+     */
+	GridCell add_center(int eid, float x1, float y1, float x2, float y2) {
+		int row, col;
+		hash_func(row, col, (x1 + x2) * 0.5f, (y1 + y2) * 0.5f);
+		auto hash = (col % 100) + 100 * (row % 100);
+
+		auto node = allocateNode();
+		node->data.store(eid, std::memory_order_relaxed);
+		pushNode(hash, node);
+		return {eid, hash};
+	};
 
-				// insert object into bucket
-				auto node = allocateNode();
-				node->data = eid;
-				node->next = bucket;
-				bucket = node;
+	/*
+     * Move an entity added with add to a new AABB.
+	 *
+	 * Used when the grid is kept between frames instead of cleared, the
+	 * grid must be created persistent. Nothing happens if the AABB still
+	 * covers the same buckets, otherwise the entity is tombstoned in its old
+	 * buckets and inserted into the new ones. Moves of different entities
+	 * may run concurrently.
+	 *
+	 * returns true if the entity changed buckets
+     */
+	bool move(GridNode *id, float x1, float y1, float x2, float y2) {
+		int eid = id->data.load(std::memory_order_relaxed);
+		int row1, col1, row2, col2;
 
-				// add bucket to reference list
-				auto r = allocateNode();
-				r->data = hash;
-				r->next = ref;
-				ref = r;
+		// hash floating point coordinate into integer coordinates
+		hash_func(row1, col1, x1, y1);
+		hash_func(row2, col2, x2, y2);
+
+		// reference list is stored last bucket first, compare backwards
+		auto *r = id->next;
+		bool same = true;
+		for (auto i = row2; same && i >= row1; i--) {
+			for (auto j = col2; same && j >= col1; j--) {
+				auto hash = (j % 100) + 100 * (i % 100);
+				if (!r || r->data.load(std::memory_order_relaxed) != hash) same = false;
+				else r = r->next;
 			}
 		}
+		if (same && !r) return false;
 
-		// make id node first
-		id->next = ref;
-		return id;
+		// leave old buckets, purge unlinks the nodes later
+		tombstone(id);
+		freeNodeList(id->next);
+
+		id->next = insertCells(eid, row1, col1, row2, col2);
+		return true;
 	};
 
 	/*
-     * Clears the grid after each iteration
+     * Remove an entity added with add from a persistent grid, the handle
+	 * becomes invalid. Its bucket nodes are unlinked by purge.
      */
-	void clear(void) {
+	void remove(GridNode *id) {
+		tombstone(id);
+		freeNodeList(id);
+	};
+
+	/*
+     * Unlink the buckets of moved and removed entities. Must not run
+	 * concurrently with move, remove or query.
+     */
+	void purge(void) {
+		if (dead.load() == 0) return;
+
 		for (auto &bucket : buckets) {
-			while (bucket) {
-				auto *node = bucket;
-				bucket = node->next;
-				freeNode(node);
+			auto *prev = (GridNode*) nullptr;
+			auto *curr = bucket.load();
+			while (curr) {
+				auto *next = curr->next;
+				if (curr->data.load(std::memory_order_relaxed) == GRID_TOMBSTONE) {
+					if (prev) prev->next = next;
+					else bucket.store(next);
+					freeNode(curr);
+				} else {
+					prev = curr;
+				}
+				curr = next;
 			}
 		}
+		dead.store(0);
 	};
 
 	/*
-     * return reference list to memory, all entities must do this or
-     * it will leak the grid's nodepool memory.
+     * Clears the grid after each iteration, every reference list returned
+	 * by add becomes invalid. Only buckets used since the last clear are
+	 * visited. Must not run concurrently with any other operation.
+     */
+	void clear(void) {
+		if (scanAll()) {
+			for (auto &bucket : buckets) bucket.store(nullptr);
+		} else {
+			for (int i = 0; i < num_dirty.load(); i++) buckets[dirty[i]].store(nullptr);
+		}
+		num_dirty.store(0);
+		dead.store(0);
+		resetNodes();
+	};
+
+	/*
+     * Clears the grid with the workers of a pool, chunk buckets per task.
+	 *
+	 * Does not wait for the tasks so other tasks of the next frame, such as
+	 * integrating positions, may be issued alongside. The grid must not be
+	 * used until pool.wait returns.
+     */
+	void clear(ThreadPool &pool, int chunk = 512) {
+		bool all = scanAll();
+		int n = all ? buckets.size() : num_dirty.load();
+		for (int begin = 0; begin < n; begin += chunk) {
+			int end = std::min(begin + chunk, n);
+			pool.add([this, all, begin, end] {
+				for (int i = begin; i < end; i++) {
+					buckets[all ? i : dirty[i]].store(nullptr);
+				}
+			}, "GridLF::clear");
+		}
+		num_dirty.store(0);
+		dead.store(0);
+		resetNodes();
+	};
+
+	/*
+     * return reference list to memory. Only needed for entities removed
+	 * from a persistent grid, clear returns every node of the other grids.
      */
 	void returnRefNodes(GridNode *nodes) {
 		freeNodeList(nodes);
 	};
 
+	/*
+     * size of a cell
+     */
+	float cellSize(void) {
+		return cell_size;
+	};
+
+	/*
+     * number of nodes allocated and freed by all threads since the grid
+	 * was created. Must not run concurrently with add or move.
+     */
+	void stats(long &alloc, long &freed) {
+		alloc = 0;
+		freed = 0;
+		for (auto &arena : arenas) {
+			alloc += arena.alloc;
+			freed += arena.freed;
+		}
+	};
+
 	/*
      * query possible collisions from a given eid
      */
 	void query(GridNode *node) {
 		// first node stores eid
-		int eid = node->data;
+		int eid = node->data.load(std::memory_order_relaxed);
 
-		// list of collisions
+		// entities already seen from another bucket
 		// used to remove duplicate collisions between
 		// same objects in different cells
-		GridNode *collisions = build_sentinels();
+		auto &visited = VisitedSet::local();
+		visited.reset();
 
 		// for every bucket in reference
 		for (auto *i = node->next; i; i = i->next) {
 
 			// for every node in bucket
-			for (auto *j = buckets[i->data]; j; j = j->next) {
+			for (auto *j = buckets[i->data.load(std::memory_order_relaxed)].load(); j; j = j->next) {
+				int other = j->data.load(std::memory_order_relaxed);
 
-				// ignore symmetric collisons and collisions with self
-				if (j->data <= eid) continue;
+				// ignore symmetric collisons, collisions with self
+				// and tombstones
+				if (other <= eid) continue;
 
-				// find position on collision list
-				auto *prev = collisions;
-				auto *curr = prev->next;
-				while (j->data > curr->data) curr = curr->next;
+				// collision already reported, skip
+				if (!visited.insert(other)) continue;
 
-				// position already exists, skip
-				if (curr->data == j->data) continue;
-
-				auto *node = allocateNode();
-				node->data = j->data;
-				node->next = curr;
-				prev->next = node;
+				std::cout << eid << " intersects " << other << std::endl;
 			}
 		}
-
-		// cycle collisions
-		for (auto *curr = collisions->next; curr->next; curr = curr->next) {
-			std::cout << eid << " intersects " << curr->data << std::endl;
-		}
-
-		freeNodeList(collisions);
 	};
 
 	void query_callback(GridNode *node, std::function<void(int,int)> func) {
 		// first node stores eid
-		int eid = node->data;
+		int eid = node->data.load(std::memory_order_relaxed);
 
-		// list of collisions
+		// entities already seen from another bucket
 		// used to remove duplicate collisions between
 		// same objects in different cells
-		GridNode *collisions = build_sentinels();
+		auto &visited = VisitedSet::local();
+		visited.reset();
 
 		// for every bucket in reference
 		for (auto *i = node->next; i; i = i->next) {
 
 			// for every node in bucket
-			for (auto *j = buckets[i->data]; j; j = j->next) {
+			for (auto *j = buckets[i->data.load(std::memory_order_relaxed)].load(); j; j = j->next) {
+				int other = j->data.load(std::memory_order_relaxed);
 
-				// ignore symmetric collisons and collisions with self
-				if (j->data <= eid) continue;
+				// ignore symmetric collisons, collisions with self
+				// and tombstones
+				if (other <= eid) continue;
 
-				// find position on collision list
-				auto *prev = collisions;
-				auto *curr = prev->next;
-				while (j->data > curr->data) curr = curr->next;
+				// collision already reported, skip
+				if (!visited.insert(other)) continue;
 
-				// position already exists, skip
-				if (curr->data == j->data) continue;
+				func(eid, other);
+			}
+		}
+	};
+
+	/*
+     * query possible collisions of an entity added with add_center, the
+	 * entity of the handle is passed first.
+	 *
+	 * Only half of the 3 x 3 neighborhood is visited, the own cell and the
+	 * cells to the right and below. Every pair of neighboring cells is
+	 * visited from one side only, so every pair is reported once without
+	 * deduplication.
+     */
+	void query_cell(GridCell cell, std::function<void(int,int)> func) {
+		static const int stencil[4][2] = {{0, 1}, {1, -1}, {1, 0}, {1, 1}};
+
+		int row = cell.hash / 100;
+		int col = cell.hash % 100;
+
+		// own cell, ignore symmetric collisons, collisions with self
+		// and tombstones
+		for (auto *j = buckets[cell.hash].load(); j; j = j->next) {
+			int other = j->data.load(std::memory_order_relaxed);
+			if (other <= cell.eid) continue;
+			func(cell.eid, other);
+		}
 
-				auto *node = allocateNode();
-				node->data = j->data;
-				node->next = curr;
-				prev->next = node;
+		for (auto &offset : stencil) {
+			auto i = (row + offset[0]) % 100;
+			auto j = (col + offset[1] + 100) % 100;
+
+			for (auto *k = buckets[j + 100 * i].load(); k; k = k->next) {
+				int other = k->data.load(std::memory_order_relaxed);
+				if (other == GRID_TOMBSTONE) continue;
+				func(cell.eid, other);
 			}
 		}
+	};
+
+	/*
+     * query every entity in the buckets covering an AABB other than eid.
+	 *
+	 * the AABB does not need to be inserted into the grid, which is used to
+	 * look up entities stored in a different grid.
+     */
+	void query_region(int eid, float x1, float y1, float x2, float y2, std::function<void(int,int)> func) {
+		int row1, col1, row2, col2;
+
+		// hash floating point coordinate into integer coordinates
+		hash_func(row1, col1, x1, y1);
+		hash_func(row2, col2, x2, y2);
+
+		// entities already seen from another bucket
+		auto &visited = VisitedSet::local();
+		visited.reset();
+
+		for (auto i = row1; i <= row2; i++) {
+			for (auto j = col1; j <= col2; j++) {
+				auto hash = (j % 100) + 100 * (i % 100);
+
+				// for every node in bucket
+				for (auto *k = buckets[hash].load(); k; k = k->next) {
+					int other = k->data.load(std::memory_order_relaxed);
+
+					// ignore collisions with self and tombstones
+					if (other == eid || other == GRID_TOMBSTONE) continue;
+
+					// collision already reported, skip
+					if (!visited.insert(other)) continue;
 
-		// cycle collisions
-		for (auto *curr = collisions->next; curr->next; curr = curr->next) {
-			func(eid, curr->data);
+					func(eid, other);
+				}
+			}
 		}
+	};
+
+	/*
+     * Cast a ray through the grid, walking the cells it crosses in order.
+	 *
+	 * The grid only knows which cells an entity covers, sink is called once
+	 * for every entity in those cells and returns the t at which the ray
+	 * hits it, or a negative value for a miss. With first_hit the walk stops
+	 * once a hit is closer than the end of the current cell, otherwise sink
+	 * sees every entity along the ray.
+	 *
+	 * t is measured from ox, oy even if it lies outside the grid, the walk
+	 * starts where the ray enters positive coordinates. It ends at max_t
+	 * or after GRID_RAY_CELLS cells.
+	 *
+	 * returns the closest hit
+     */
+	GridRayHit raycast(float ox, float oy, float dx, float dy, float max_t, std::function<float(int)> sink, bool first_hit = true) {
+		GridRay ray = {ox, oy, dx, dy, max_t};
+		return castRay(ray, sink, first_hit);
+	};
 
-		freeNodeList(collisions);
+	/*
+     * Cast a batch of rays in parallel, chunk rays per task. sink is called
+	 * with the index of the ray and an entity, hits[i] is set to the closest
+	 * hit of rays[i].
+     */
+	void raycast(ThreadPool &pool, const std::vector<GridRay> &rays, std::vector<GridRayHit> &hits, std::function<float(int,int)> sink, bool first_hit = true, int chunk = 64) {
+		hits.resize(rays.size());
+
+		for (int begin = 0; begin < (int) rays.size(); begin += chunk) {
+			int end = std::min(begin + chunk, (int) rays.size());
+			pool.add([this, &rays, &hits, sink, first_hit, begin, end] {
+				// one sink per task, the ray index is read by reference
+				int i;
+				std::function<float(int)> f = [&sink, &i](int eid) { return sink(i, eid); };
+				for (i = begin; i < end; i++) {
+					hits[i] = castRay(rays[i], f, first_hit);
+				}
+			}, "GridLF::raycast");
+		}
+		pool.wait("GridLF::raycast");
+	};
+
+	/*
+     * Report every entity stored in a cell within r of x, y. Cells are
+	 * visited ring by ring around the cell of the point, cells whose nearest
+	 * point is farther than r are skipped. sink receives every entity once,
+	 * the caller tests the exact distance.
+     */
+	void query_radius(float x, float y, float r, std::function<void(int)> sink) {
+		GridProbe probe = {x, y, r};
+		radiusQuery(probe, sink);
+	};
+
+	/*
+     * Find the k entities nearest to x, y within max_r, closest first.
+	 *
+	 * dist returns the distance from the point to an entity, it must not be
+	 * smaller than the distance to the AABB the entity was added with.
+	 * Rings of cells are visited until no unvisited cell can hold an entity
+	 * closer than the k-th neighbor found.
+	 *
+	 * returns the number of neighbors found
+     */
+	int query_knn(float x, float y, int k, std::function<float(int)> dist, std::vector<GridNeighbor> &out, float max_r = std::numeric_limits<float>::infinity()) {
+		GridProbe probe = {x, y, max_r};
+		knnQuery(probe, k, dist, out);
+		return out.size();
+	};
+
+	/*
+     * Radius queries of a batch of probes in parallel, chunk probes per task.
+	 * sink is called with the index of the probe and an entity.
+     */
+	void query_radius(ThreadPool &pool, const std::vector<GridProbe> &probes, std::function<void(int,int)> sink, int chunk = 64) {
+		for (int begin = 0; begin < (int) probes.size(); begin += chunk) {
+			int end = std::min(begin + chunk, (int) probes.size());
+			pool.add([this, &probes, sink, begin, end] {
+				// one sink per task, the probe index is read by reference
+				int i;
+				std::function<void(int)> f = [&sink, &i](int eid) { sink(i, eid); };
+				for (i = begin; i < end; i++) {
+					radiusQuery(probes[i], f);
+				}
+			}, "GridLF::query_radius");
+		}
+		pool.wait("GridLF::query_radius");
+	};
+
+	/*
+     * Nearest neighbor queries of a batch of probes in parallel, chunk
+	 * probes per task. dist is called with the index of the probe and an
+	 * entity. The neighbors of probes[i] are stored closest first in
+	 * out[i * k] to out[i * k + k - 1]. out is empty if k is not positive.
+     */
+	void query_knn(ThreadPool &pool, const std::vector<GridProbe> &probes, int k, std::function<float(int,int)> dist, std::vector<GridNeighbor> &out, int chunk = 64) {
+		if (k <= 0) {
+			out.clear();
+			return;
+		}
+		out.resize(probes.size() * k);
+
+		for (int begin = 0; begin < (int) probes.size(); begin += chunk) {
+			int end = std::min(begin + chunk, (int) probes.size());
+			pool.add([this, &probes, &out, k, dist, begin, end] {
+				int i;
+				std::function<float(int)> f = [&dist, &i](int eid) { return dist(i, eid); };
+				std::vector<GridNeighbor> found;
+				for (i = begin; i < end; i++) {
+					knnQuery(probes[i], k, f, found);
+
+					auto *o = &out[i * k];
+					for (int j = 0; j < k; j++) {
+						if (j < (int) found.size()) o[j] = found[j];
+						else o[j] = {-1, std::numeric_limits<float>::infinity()};
+					}
+				}
+			}, "GridLF::query_knn");
+		}
+		pool.wait("GridLF::query_knn");
 	};
 
 	/*
@@ -284,9 +998,11 @@ class GridLF {
      */
 	void print(void) {
 		for (int i = 0; i < buckets.size(); i++) {
-			for (auto *node = buckets[i]; node; node = node->next) {
+			for (auto *node = buckets[i].load(); node; node = node->next) {
+				int eid = node->data.load(std::memory_order_relaxed);
+				if (eid == GRID_TOMBSTONE) continue;
 				std::cout << "bucket " << i;
-				std::cout << " item " << node->data << std::endl;
+				std::cout << " item " << eid << std::endl;
 			}
 		}
 	};
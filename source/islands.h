@@ -0,0 +1,196 @@
+#ifndef ISLANDS
+#define ISLANDS
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+/*
+ * Sleeping entities, grouped into islands of entities touching each other.
+ *
+ * Awake entities touching during a frame are joined with a lock-free
+ * union-find. An island whose entities have all been still for a number of
+ * frames falls asleep as a whole and keeps its links, so an awake entity
+ * touching any member wakes every member at the end of the frame.
+ *
+ * The world iterates awake() instead of every entity, sleeping entities
+ * are not moved, added to the broadphase or queried.
+ */
+class Islands {
+	// frames an island must be still before it falls asleep
+	int frames;
+
+	// union-find parent, sleeping entities point straight at the root
+	std::vector<std::atomic<int>> parent;
+
+	std::vector<char> asleep;
+
+	// frames each entity has been still in a row
+	std::vector<int> still;
+
+	// members of a sleeping island linked from its root, -1 ends the list
+	std::vector<int> member;
+
+	// roots of sleeping islands touched by an awake entity this frame
+	std::vector<std::atomic<bool>> touched;
+	std::vector<int> wake;
+	std::atomic<int> num_wake;
+
+	// islands whose entities are all still
+	std::vector<char> calm;
+
+	// awake entities in ascending order, and the entities which changed
+	// state in the last update
+	std::vector<int> awake_list;
+	std::vector<int> slept;
+	std::vector<int> woken;
+
+	/*
+     * join the islands of two awake entities, the smaller root wins
+     */
+	void unite(int a, int b) {
+		while (true) {
+			a = find(a);
+			b = find(b);
+			if (a == b) return;
+			if (a > b) std::swap(a, b);
+
+			int expected = b;
+			bool s = parent[b].compare_exchange_strong(expected, a);
+			if (s) return;
+		}
+	};
+
+	/*
+     * wake the sleeping island of i at the end of the frame
+     */
+	void touch(int i) {
+		int root = find(i);
+		if (!touched[root].exchange(true)) wake[num_wake.fetch_add(1)] = root;
+	};
+
+	public:
+
+	Islands(int n, int f) : parent(n), asleep(n, 0), still(n, 0), member(n, -1), touched(n), wake(n), calm(n, 0) {
+		frames = f;
+		num_wake.store(0);
+		for (int i = 0; i < n; i++) {
+			parent[i].store(i);
+			touched[i].store(false);
+			awake_list.push_back(i);
+		}
+	};
+
+	/*
+     * root of the island of i, halving the path on the way
+     */
+	int find(int i) {
+		while (true) {
+			int p = parent[i].load();
+			if (p == i) return i;
+
+			int g = parent[p].load();
+			if (g != p) parent[i].compare_exchange_weak(p, g);
+			i = g;
+		}
+	};
+
+	/*
+     * record two entities touching, may run concurrently with other
+	 * contacts
+     */
+	void contact(int a, int b) {
+		bool sa = asleep[a];
+		bool sb = asleep[b];
+		if (sa && sb) return;
+
+		if (sa) touch(a);
+		else if (sb) touch(b);
+		else unite(a, b);
+	};
+
+	bool sleeping(int i) {
+		return asleep[i];
+	};
+
+	/*
+     * awake entities in ascending order
+     */
+	const std::vector<int>& awake(void) {
+		return awake_list;
+	};
+
+	/*
+     * entities which fell asleep or woke up in the last update
+     */
+	const std::vector<int>& fell_asleep(void) {
+		return slept;
+	};
+
+	const std::vector<int>& woke_up(void) {
+		return woken;
+	};
+
+	/*
+     * End the frame after every contact was recorded. is_still(i) tells
+	 * whether awake entity i moved slowly enough to sleep this frame.
+	 *
+	 * Touched islands wake up, islands still for long enough fall asleep
+	 * and every awake entity starts the next frame on an island of its
+	 * own. Must not run concurrently with contact.
+     */
+	template<class F>
+	void update(F is_still) {
+		slept.clear();
+		woken.clear();
+
+		// wake touched islands
+		for (int k = 0; k < num_wake.load(); k++) {
+			int root = wake[k];
+			touched[root].store(false);
+			for (int i = root; i != -1; i = member[i]) {
+				asleep[i] = 0;
+				still[i] = 0;
+				woken.push_back(i);
+			}
+		}
+		num_wake.store(0);
+
+		// an island is calm if all of its entities have been still
+		for (int i : awake_list) {
+			still[i] = is_still(i) ? still[i] + 1 : 0;
+			calm[find(i)] = 1;
+		}
+		for (int i : awake_list) {
+			if (still[i] < frames) calm[find(i)] = 0;
+		}
+
+		// put calm islands to sleep, every root is awake and in the list
+		int n = 0;
+		for (int i : awake_list) {
+			int root = find(i);
+			if (calm[root]) {
+				asleep[i] = 1;
+				parent[i].store(root);
+				member[i] = -1;
+				slept.push_back(i);
+			} else {
+				awake_list[n++] = i;
+			}
+		}
+		awake_list.resize(n);
+
+		for (int i : slept) {
+			int root = parent[i].load();
+			if (i == root) continue;
+			member[i] = member[root];
+			member[root] = i;
+		}
+
+		awake_list.insert(awake_list.end(), woken.begin(), woken.end());
+		std::sort(awake_list.begin(), awake_list.end());
+		for (int i : awake_list) parent[i].store(i);
+	};
+};
+
+#endif
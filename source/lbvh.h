@@ -0,0 +1,419 @@
+#ifndef LINEAR_BVH
+#define LINEAR_BVH
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <limits>
+
+#include "threadpool.h"
+
+/*
+ * bounding box of a node in the linear bvh
+ */
+struct LBVHBox {
+	float x1, y1;
+	float x2, y2;
+};
+
+/*
+ * Linear bounding volume hierarchy rebuilt from scratch every frame.
+ *
+ * build goes through the following phases, each split into chunks which run
+ * as ThreadPool tasks:
+ * - bounds of the scene and 32 bit Morton codes of the box centers
+ * - LSD radix sort of the codes, 4 passes of 8 bits
+ * - hierarchy emission, every inner node finds its own range and split
+ *   (Karras 2012) so all nodes are built independently
+ * - bottom-up refit, the second child to arrive at a node computes its box
+ *
+ * Inner nodes are 0 to n - 2, leaf i of the sorted order is node n - 1 + i.
+ */
+class LBVH {
+	// number of entities added this frame
+	std::atomic<int> count;
+
+	// entities in insertion order, indexed by handle
+	std::vector<int> eids;
+	std::vector<LBVHBox> boxes;
+
+	// sort keys and handles, double buffered for the radix sort
+	std::vector<uint32_t> codes;
+	std::vector<uint32_t> codes_tmp;
+	std::vector<int> sorted;
+	std::vector<int> sorted_tmp;
+
+	// histogram of every chunk during a radix pass
+	std::vector<std::array<int, 256>> histograms;
+
+	// tree, see class comment for node numbering
+	std::vector<LBVHBox> nodes;
+	std::vector<int> left;
+	std::vector<int> right;
+	std::vector<int> parent;
+
+	// last sorted leaf below every inner node
+	std::vector<int> last;
+
+	// refit arrival counter of every inner node
+	std::vector<std::atomic<int>> arrivals;
+
+	// candidate pairs found by find_pairs, one buffer per chunk
+	std::vector<std::vector<std::pair<int,int>>> pair_buffers;
+
+	int chunk;
+
+	/*
+	 * spread the lower 16 bits of x to the even bits
+	 */
+	uint32_t spread(uint32_t x) {
+		x &= 0x0000FFFF;
+		x = (x | (x << 8)) & 0x00FF00FF;
+		x = (x | (x << 4)) & 0x0F0F0F0F;
+		x = (x | (x << 2)) & 0x33333333;
+		x = (x | (x << 1)) & 0x55555555;
+		return x;
+	};
+
+	/*
+	 * length of the common prefix of two sorted keys, ties are broken by
+	 * position so all keys are distinct. -1 outside the array.
+	 */
+	int delta(int i, int j) {
+		int n = count.load(std::memory_order_relaxed);
+		if (j < 0 || j >= n) return -1;
+
+		auto a = codes[i];
+		auto b = codes[j];
+		if (a == b) return 32 + __builtin_clz((uint32_t) (i ^ j));
+		return __builtin_clz(a ^ b);
+	};
+
+	/*
+	 * run func(chunk, begin, end) over [0, n) as pool tasks
+	 */
+	void parallel(ThreadPool &pool, int n, std::function<void(int,int,int)> func) {
+		for (int c = 0, begin = 0; begin < n; c++, begin += chunk) {
+			int end = std::min(begin + chunk, n);
+			pool.add([func, c, begin, end] { func(c, begin, end); }, "LBVH::parallel");
+		}
+		pool.wait("LBVH::parallel");
+	};
+
+	int chunks(int n) {
+		return (n + chunk - 1) / chunk;
+	};
+
+	/*
+	 * determine children of inner node i
+	 */
+	void emit(int i) {
+		int n = count.load(std::memory_order_relaxed);
+
+		// direction of the range
+		int d = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+
+		// upper bound of the range length
+		int delta_min = delta(i, i - d);
+		int lmax = 2;
+		while (delta(i, i + lmax * d) > delta_min) lmax *= 2;
+
+		// exact other end by binary search
+		int l = 0;
+		for (int t = lmax / 2; t >= 1; t /= 2) {
+			if (delta(i, i + (l + t) * d) > delta_min) l += t;
+		}
+		int j = i + l * d;
+
+		// split position by binary search
+		int delta_node = delta(i, j);
+		int s = 0;
+		for (int t = (l + 1) / 2; ; t = (t + 1) / 2) {
+			if (delta(i, i + (s + t) * d) > delta_node) s += t;
+			if (t == 1) break;
+		}
+		int split = i + s * d + std::min(d, 0);
+
+		int first = std::min(i, j);
+		int range_last = std::max(i, j);
+
+		left[i] = first == split ? n - 1 + split : split;
+		right[i] = range_last == split + 1 ? n - 1 + split + 1 : split + 1;
+		last[i] = range_last;
+
+		parent[left[i]] = i;
+		parent[right[i]] = i;
+	};
+
+	/*
+	 * walk up from leaf i, the second child to arrive refits the node
+	 */
+	void refit(int i) {
+		int n = count.load(std::memory_order_relaxed);
+		int node = n - 1 + i;
+		nodes[node] = boxes[sorted[i]];
+
+		while (node != 0) {
+			node = parent[node];
+			if (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 0) return;
+
+			auto &a = nodes[left[node]];
+			auto &b = nodes[right[node]];
+			auto &box = nodes[node];
+			box.x1 = std::min(a.x1, b.x1);
+			box.y1 = std::min(a.y1, b.y1);
+			box.x2 = std::max(a.x2, b.x2);
+			box.y2 = std::max(a.y2, b.y2);
+		}
+	};
+
+	bool overlap(LBVHBox &a, LBVHBox &b) {
+		if (a.x1 > b.x2 || b.x1 > a.x2) return false;
+		if (a.y1 > b.y2 || b.y1 > a.y2) return false;
+		return true;
+	};
+
+	/*
+	 * report leaves after sorted position i overlapping box
+	 */
+	template<class F>
+	void traverse(int i, LBVHBox &box, F func) {
+		int n = count.load(std::memory_order_relaxed);
+		if (n < 2) return;
+
+		// deep enough for 32 bit codes plus 32 bits of tie breaking
+		int stack[128];
+		int top = 0;
+		stack[top++] = 0;
+
+		while (top) {
+			int node = stack[--top];
+			if (!overlap(box, nodes[node])) continue;
+
+			if (node >= n - 1) {
+				int k = node - (n - 1);
+				if (k > i) func(sorted[k]);
+				continue;
+			}
+
+			// subtree only contains leaves already checked from their side
+			if (last[node] <= i) continue;
+
+			stack[top++] = left[node];
+			stack[top++] = right[node];
+		}
+	};
+
+	public:
+
+	/*
+	 * max_entities is the number of entities that can be added per frame,
+	 * c is the number of entities per task.
+	 */
+	LBVH(int max_entities = 1048576, int c = 4096) {
+		count.store(0);
+		chunk = c;
+
+		eids.resize(max_entities);
+		boxes.resize(max_entities);
+		codes.resize(max_entities);
+		codes_tmp.resize(max_entities);
+		sorted.resize(max_entities);
+		sorted_tmp.resize(max_entities);
+
+		nodes.resize(2 * max_entities);
+		left.resize(max_entities);
+		right.resize(max_entities);
+		parent.resize(2 * max_entities);
+		last.resize(max_entities);
+		arrivals = std::vector<std::atomic<int>>(max_entities);
+
+		histograms.resize(chunks(max_entities));
+		pair_buffers.resize(chunks(max_entities));
+	};
+
+	/*
+	 * Record an entity for the next build.
+	 *
+	 * the function assumes x1, y1 is less than x2, y2.
+	 *
+	 * returns a handle used for queries until the tree is cleared
+	 */
+	int add(int eid, float x1, float y1, float x2, float y2) {
+		auto h = count.fetch_add(1);
+		eids[h] = eid;
+		boxes[h].x1 = x1;
+		boxes[h].y1 = y1;
+		boxes[h].x2 = x2;
+		boxes[h].y2 = y2;
+		return h;
+	};
+
+	/*
+	 * build the tree over every entity added this frame
+	 */
+	void build(ThreadPool &pool) {
+		int n = count.load();
+		if (n == 0) return;
+		int m = chunks(n);
+
+		// bounds of the box centers, per chunk then combined
+		std::vector<LBVHBox> bounds(m);
+		parallel(pool, n, [this, &bounds](int c, int begin, int end) {
+			auto inf = std::numeric_limits<float>::infinity();
+			LBVHBox b = {inf, inf, -inf, -inf};
+			for (int i = begin; i < end; i++) {
+				auto cx = boxes[i].x1 + boxes[i].x2;
+				auto cy = boxes[i].y1 + boxes[i].y2;
+				b.x1 = std::min(b.x1, cx);
+				b.y1 = std::min(b.y1, cy);
+				b.x2 = std::max(b.x2, cx);
+				b.y2 = std::max(b.y2, cy);
+			}
+			bounds[c] = b;
+		});
+		auto scene = bounds[0];
+		for (auto &b : bounds) {
+			scene.x1 = std::min(scene.x1, b.x1);
+			scene.y1 = std::min(scene.y1, b.y1);
+			scene.x2 = std::max(scene.x2, b.x2);
+			scene.y2 = std::max(scene.y2, b.y2);
+		}
+
+		// morton codes of the centers on a 65536 x 65536 lattice
+		auto sx = 65535.0f / std::max(scene.x2 - scene.x1, 1e-6f);
+		auto sy = 65535.0f / std::max(scene.y2 - scene.y1, 1e-6f);
+		parallel(pool, n, [this, scene, sx, sy](int, int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				uint32_t x = (boxes[i].x1 + boxes[i].x2 - scene.x1) * sx;
+				uint32_t y = (boxes[i].y1 + boxes[i].y2 - scene.y1) * sy;
+				codes[i] = spread(x) | (spread(y) << 1);
+				sorted[i] = i;
+			}
+		});
+
+		// radix sort, stable so equal codes stay in handle order
+		for (int shift = 0; shift < 32; shift += 8) {
+			parallel(pool, n, [this, shift](int c, int begin, int end) {
+				auto &hist = histograms[c];
+				hist.fill(0);
+				for (int i = begin; i < end; i++) hist[(codes[i] >> shift) & 0xFF]++;
+			});
+
+			// exclusive prefix sum, digit major then chunk
+			int total = 0;
+			for (int digit = 0; digit < 256; digit++) {
+				for (int c = 0; c < m; c++) {
+					auto k = histograms[c][digit];
+					histograms[c][digit] = total;
+					total += k;
+				}
+			}
+
+			parallel(pool, n, [this, shift](int c, int begin, int end) {
+				auto &hist = histograms[c];
+				for (int i = begin; i < end; i++) {
+					auto pos = hist[(codes[i] >> shift) & 0xFF]++;
+					codes_tmp[pos] = codes[i];
+					sorted_tmp[pos] = sorted[i];
+				}
+			});
+			std::swap(codes, codes_tmp);
+			std::swap(sorted, sorted_tmp);
+		}
+
+		// inner nodes are independent of each other
+		parallel(pool, n - 1, [this](int, int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				emit(i);
+				arrivals[i].store(0, std::memory_order_relaxed);
+			}
+		});
+
+		parallel(pool, n, [this](int, int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				refit(i);
+			}
+		});
+	};
+
+	/*
+	 * find every overlapping pair once, in parallel. Pairs of a chunk of
+	 * leaves go into the buffer of that chunk.
+	 *
+	 * returns the number of pairs found
+	 */
+	int find_pairs(ThreadPool &pool) {
+		int n = count.load();
+		std::atomic<int> total(0);
+
+		parallel(pool, n, [this, &total](int c, int begin, int end) {
+			auto &buffer = pair_buffers[c];
+			buffer.clear();
+			for (int i = begin; i < end; i++) {
+				auto a = sorted[i];
+				traverse(i, boxes[a], [this, a, &buffer](int b) {
+					buffer.emplace_back(eids[a], eids[b]);
+				});
+			}
+			total.fetch_add(buffer.size());
+		});
+		return total.load();
+	};
+
+	/*
+	 * call func on every pair found by the last find_pairs
+	 */
+	void for_each_pair(std::function<void(int,int)> func) {
+		int m = chunks(count.load());
+		for (int c = 0; c < m; c++) {
+			for (auto &p : pair_buffers[c]) func(p.first, p.second);
+		}
+	};
+
+	/*
+	 * pair buffer of a chunk, so callers can consume chunks in parallel
+	 */
+	std::vector<std::pair<int,int>>& pairs(int c) {
+		return pair_buffers[c];
+	};
+
+	int num_chunks(void) {
+		return chunks(count.load());
+	};
+
+	/*
+     * query possible collisions from a given handle
+     */
+	void query_callback(int h, std::function<void(int,int)> func) {
+		int eid = eids[h];
+		traverse(-1, boxes[h], [this, eid, &func](int b) {
+			// ignore symmetric collisons and collisions with self
+			if (eids[b] > eid) func(eid, eids[b]);
+		});
+	};
+
+	/*
+     * Clears the tree after each iteration
+     */
+	void clear(void) {
+		count.store(0);
+	};
+
+	/*
+     * print the leaves in sorted order
+     */
+	void print(void) {
+		int n = count.load();
+		for (int i = 0; i < n; i++) {
+			auto h = sorted[i];
+			std::cout << eids[h] << " code " << codes[i];
+			std::cout << " @ " << boxes[h].x1 << ", " << boxes[h].y1 << std::endl;
+		}
+	};
+};
+
+#endif
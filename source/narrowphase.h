@@ -0,0 +1,402 @@
+#ifndef NARROWPHASE
+#define NARROWPHASE
+
+#include <array>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "entity_soa.h"
+#include "threadslot.h"
+#include "threadpool.h"
+
+// pairs of a buffer tested by one task
+const int NARROWPHASE_CHUNK = 1024;
+
+// colours of contact batches, contacts which do not fit are resolved last,
+// one after another
+const int CONTACT_COLORS = 64;
+
+/*
+ * Time of first contact between circles of radius r, as a fraction of the
+ * step, for n pairs a[k], b[k] moving from position0 to position1.
+ *
+ * t[k] is in [0, 1) when the circles touch during the step, 1 when they only
+ * overlap at its end and -1 when they do not touch. Circles overlapping at
+ * the start of the step are not moved back, their time is 1 as well.
+ *
+ * Pair data is gathered into blocks of 8, evaluated with AVX, SSE or plain
+ * loops. The length of the relative motion is computed once per pair.
+ */
+inline void contact_times(EntitySoA &body, float r, const int *a, const int *b, int n, float *t) {
+	auto *x0 = body.x0;
+	auto *y0 = body.y0;
+	auto *x1 = body.x1;
+	auto *y1 = body.y1;
+
+	const float diameter = 2.f * r;
+	const float diameter2 = diameter * diameter;
+
+	int k = 0;
+#if defined(__AVX__) || defined(__SSE2__)
+	alignas(32) float ax0[8], ay0[8], ax1[8], ay1[8];
+	alignas(32) float bx0[8], by0[8], bx1[8], by1[8];
+
+	for (; k + 8 <= n; k += 8) {
+		// gather the positions of 8 pairs
+		for (int l = 0; l < 8; l++) {
+			int i = a[k + l];
+			int j = b[k + l];
+			ax0[l] = x0[i]; ay0[l] = y0[i]; ax1[l] = x1[i]; ay1[l] = y1[i];
+			bx0[l] = x0[j]; by0[l] = y0[j]; bx1[l] = x1[j]; by1[l] = y1[j];
+		}
+
+#if defined(__AVX__)
+		const __m256 d = _mm256_set1_ps(diameter);
+		const __m256 d2 = _mm256_set1_ps(diameter2);
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.f);
+		const __m256 none = _mm256_set1_ps(-1.f);
+		const __m256 sign = _mm256_set1_ps(-0.0f);
+
+		// distance from b to a at the start and end of the step
+		auto dx = _mm256_sub_ps(_mm256_load_ps(ax0), _mm256_load_ps(bx0));
+		auto dy = _mm256_sub_ps(_mm256_load_ps(ay0), _mm256_load_ps(by0));
+		auto ex = _mm256_sub_ps(_mm256_load_ps(ax1), _mm256_load_ps(bx1));
+		auto ey = _mm256_sub_ps(_mm256_load_ps(ay1), _mm256_load_ps(by1));
+
+		// motion of a relative to b
+		auto vx = _mm256_sub_ps(ex, dx);
+		auto vy = _mm256_sub_ps(ey, dy);
+
+		auto start = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), d2, _CMP_LT_OQ);
+		auto end = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(ex, ex), _mm256_mul_ps(ey, ey)), d2, _CMP_LT_OQ);
+
+		// 1 / length of the path, infinite when not moving, which turns
+		// every comparison below false
+		auto inv = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy))));
+
+		// distance between b and the closest point on a's path, and the
+		// distance along the path to it
+		auto closest = _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(dy, vx), _mm256_mul_ps(dx, vy)), inv);
+		closest = _mm256_andnot_ps(sign, closest);
+		auto along = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(dx, vx), _mm256_mul_ps(dy, vy)), inv);
+
+		// first point of contact, scaled by the length of the path
+		auto back = _mm256_sqrt_ps(_mm256_sub_ps(d2, _mm256_mul_ps(closest, closest)));
+		auto f = _mm256_mul_ps(_mm256_sub_ps(zero, _mm256_add_ps(along, back)), inv);
+
+		auto valid = _mm256_andnot_ps(start, _mm256_cmp_ps(closest, d, _CMP_LE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(f, zero, _CMP_GE_OQ));
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(f, one, _CMP_LT_OQ));
+
+		auto time = _mm256_blendv_ps(one, f, valid);
+		time = _mm256_blendv_ps(none, time, _mm256_or_ps(end, valid));
+		_mm256_storeu_ps(t + k, time);
+#else
+		const __m128 d = _mm_set1_ps(diameter);
+		const __m128 d2 = _mm_set1_ps(diameter2);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.f);
+		const __m128 none = _mm_set1_ps(-1.f);
+		const __m128 sign = _mm_set1_ps(-0.0f);
+
+		for (int h = 0; h < 8; h += 4) {
+			auto dx = _mm_sub_ps(_mm_load_ps(ax0 + h), _mm_load_ps(bx0 + h));
+			auto dy = _mm_sub_ps(_mm_load_ps(ay0 + h), _mm_load_ps(by0 + h));
+			auto ex = _mm_sub_ps(_mm_load_ps(ax1 + h), _mm_load_ps(bx1 + h));
+			auto ey = _mm_sub_ps(_mm_load_ps(ay1 + h), _mm_load_ps(by1 + h));
+
+			auto vx = _mm_sub_ps(ex, dx);
+			auto vy = _mm_sub_ps(ey, dy);
+
+			auto start = _mm_cmplt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), d2);
+			auto end = _mm_cmplt_ps(_mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)), d2);
+
+			auto inv = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy))));
+
+			auto closest = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(dy, vx), _mm_mul_ps(dx, vy)), inv);
+			closest = _mm_andnot_ps(sign, closest);
+			auto along = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(dx, vx), _mm_mul_ps(dy, vy)), inv);
+
+			auto back = _mm_sqrt_ps(_mm_sub_ps(d2, _mm_mul_ps(closest, closest)));
+			auto f = _mm_mul_ps(_mm_sub_ps(zero, _mm_add_ps(along, back)), inv);
+
+			auto valid = _mm_andnot_ps(start, _mm_cmple_ps(closest, d));
+			valid = _mm_and_ps(valid, _mm_cmpge_ps(f, zero));
+			valid = _mm_and_ps(valid, _mm_cmplt_ps(f, one));
+
+			// select f where valid, 1 otherwise, -1 where neither touches
+			auto time = _mm_or_ps(_mm_and_ps(valid, f), _mm_andnot_ps(valid, one));
+			auto hit = _mm_or_ps(end, valid);
+			time = _mm_or_ps(_mm_and_ps(hit, time), _mm_andnot_ps(hit, none));
+			_mm_storeu_ps(t + k + h, time);
+		}
+#endif
+	}
+#endif
+	for (; k < n; k++) {
+		int i = a[k];
+		int j = b[k];
+		float dx = x0[i] - x0[j];
+		float dy = y0[i] - y0[j];
+		float ex = x1[i] - x1[j];
+		float ey = y1[i] - y1[j];
+		float vx = ex - dx;
+		float vy = ey - dy;
+
+		bool start = dx * dx + dy * dy < diameter2;
+		bool end = ex * ex + ey * ey < diameter2;
+
+		float inv = 1.f / std::sqrt(vx * vx + vy * vy);
+		float closest = std::fabs((dy * vx - dx * vy) * inv);
+		float along = (dx * vx + dy * vy) * inv;
+		float f = -(along + std::sqrt(diameter2 - closest * closest)) * inv;
+
+		bool valid = !start && closest <= diameter && f >= 0.f && f < 1.f;
+		t[k] = valid ? f : (end ? 1.f : -1.f);
+	}
+}
+
+/*
+ * Move circles a and b back to the time of impact t, a fraction of the
+ * step, and reflect the velocity of each one which moves towards the other.
+ * Momentum is not transferred.
+ */
+inline void reflect_contact(EntitySoA &body, int a, int b, float t) {
+	float ax = body.x0[a] + t * (body.x1[a] - body.x0[a]);
+	float ay = body.y0[a] + t * (body.y1[a] - body.y0[a]);
+	float bx = body.x0[b] + t * (body.x1[b] - body.x0[b]);
+	float by = body.y0[b] + t * (body.y1[b] - body.y0[b]);
+	body.x1[a] = ax;
+	body.y1[a] = ay;
+	body.x1[b] = bx;
+	body.y1[b] = by;
+
+	// normal from a to b
+	float nx = bx - ax;
+	float ny = by - ay;
+	float len = std::sqrt(nx * nx + ny * ny);
+	if (len == 0.f) return;
+	nx /= len;
+	ny /= len;
+
+	float da = std::max(body.vx[a] * nx + body.vy[a] * ny, 0.f);
+	body.vx[a] -= 2.f * da * nx;
+	body.vy[a] -= 2.f * da * ny;
+
+	float db = std::max(-(body.vx[b] * nx + body.vy[b] * ny), 0.f);
+	body.vx[b] += 2.f * db * nx;
+	body.vy[b] += 2.f * db * ny;
+}
+
+/*
+ * Candidate pairs written by a broadphase, with one buffer per thread so
+ * pairs are appended without synchronisation. Buffers keep their memory
+ * between frames.
+ */
+class PairBuffer {
+	struct alignas(64) Slot {
+		std::vector<int> a;
+		std::vector<int> b;
+
+		// time of contact of each pair, see contact_times
+		std::vector<float> t;
+	};
+
+	std::array<Slot, MAX_THREAD_SLOTS> slots;
+
+	// colours taken by the contacts of each entity, one bit per colour
+	std::vector<uint64_t> taken;
+
+	// touching pairs sorted by colour, batch c is [first[c], first[c + 1])
+	std::vector<int> ca;
+	std::vector<int> cb;
+	std::vector<float> ct;
+	std::vector<int> color;
+	std::array<int, CONTACT_COLORS + 2> first;
+
+	/*
+     * give every touching pair the lowest colour not taken by either
+	 * entity, then sort the pairs by colour. Pairs of one colour share no
+	 * entity.
+     */
+	void colorContacts(int entities) {
+		if ((int) taken.size() < entities) taken.resize(entities, 0);
+		first.fill(0);
+		color.clear();
+
+		for (auto &slot : slots) {
+			for (int k = 0; k < (int) slot.t.size(); k++) {
+				if (slot.t[k] < 0.f) continue;
+
+				auto a = slot.a[k];
+				auto b = slot.b[k];
+				auto free = ~(taken[a] | taken[b]);
+
+				int c = CONTACT_COLORS;
+				if (free) {
+					c = __builtin_ctzll(free);
+					taken[a] |= 1ull << c;
+					taken[b] |= 1ull << c;
+				}
+				color.push_back(c);
+				first[c + 1]++;
+			}
+		}
+
+		for (int c = 0; c <= CONTACT_COLORS; c++) first[c + 1] += first[c];
+
+		int n = color.size();
+		ca.resize(n);
+		cb.resize(n);
+		ct.resize(n);
+
+		// scatter in order, pairs keep their order within a colour
+		std::array<int, CONTACT_COLORS + 1> next;
+		std::copy(first.begin(), first.end() - 1, next.begin());
+		int i = 0;
+		for (auto &slot : slots) {
+			for (int k = 0; k < (int) slot.t.size(); k++) {
+				if (slot.t[k] < 0.f) continue;
+
+				int j = next[color[i++]]++;
+				ca[j] = slot.a[k];
+				cb[j] = slot.b[k];
+				ct[j] = slot.t[k];
+
+				taken[slot.a[k]] = 0;
+				taken[slot.b[k]] = 0;
+			}
+		}
+	};
+
+	public:
+
+	PairBuffer() {
+		first.fill(0);
+	};
+
+	/*
+     * add a candidate pair, called from the broadphase query
+     */
+	void push(int a, int b) {
+		auto &slot = slots[thread_slot()];
+		slot.a.push_back(a);
+		slot.b.push_back(b);
+	};
+
+	/*
+     * number of candidate pairs
+     */
+	long size(void) {
+		long n = 0;
+		for (auto &slot : slots) n += slot.a.size();
+		return n;
+	};
+
+	/*
+     * compute the time of contact of every pair, NARROWPHASE_CHUNK pairs
+	 * per task
+     */
+	void narrowphase(ThreadPool &pool, EntitySoA &body, float r) {
+		for (auto &slot : slots) {
+			int n = slot.a.size();
+			slot.t.resize(n);
+			for (int begin = 0; begin < n; begin += NARROWPHASE_CHUNK) {
+				int count = std::min(NARROWPHASE_CHUNK, n - begin);
+				auto *s = &slot;
+				pool.add([&body, r, s, begin, count] {
+					contact_times(body, r, &s->a[begin], &s->b[begin], count, &s->t[begin]);
+				}, "PairBuffer::narrowphase");
+			}
+		}
+		pool.wait("PairBuffer::narrowphase");
+	};
+
+	/*
+     * call func(a, b, t) for every pair which touches, in the order the
+	 * pairs were added by each thread
+     */
+	void contacts(std::function<void(int,int,float)> func) {
+		for (auto &slot : slots) {
+			for (int k = 0; k < (int) slot.t.size(); k++) {
+				if (slot.t[k] >= 0.f) func(slot.a[k], slot.b[k], slot.t[k]);
+			}
+		}
+	};
+
+	/*
+     * call func(a, b, t) for every pair which touches, in parallel.
+	 *
+	 * Pairs are split into batches in which no two pairs share an entity,
+	 * batches run one after another and the pairs of a batch run on the
+	 * pool, so func may write both entities without synchronisation.
+	 * Entities are numbered below entities. The batches only depend on the
+	 * order of the pairs, not on the number of threads.
+     */
+	void resolve(ThreadPool &pool, int entities, std::function<void(int,int,float)> func, int chunk = 256) {
+		colorContacts(entities);
+
+		for (int c = 0; c < CONTACT_COLORS; c++) {
+			int begin = first[c];
+			int end = first[c + 1];
+
+			// small batches are not worth waking the pool for
+			if (end - begin <= chunk) {
+				for (int k = begin; k < end; k++) func(ca[k], cb[k], ct[k]);
+				continue;
+			}
+
+			for (int b = begin; b < end; b += chunk) {
+				int e = std::min(b + chunk, end);
+				pool.add([this, &func, b, e] {
+					for (int k = b; k < e; k++) func(ca[k], cb[k], ct[k]);
+				}, "PairBuffer::resolve");
+			}
+			pool.wait("PairBuffer::resolve");
+		}
+
+		// entities with contacts of every colour
+		for (int k = first[CONTACT_COLORS]; k < first[CONTACT_COLORS + 1]; k++) {
+			func(ca[k], cb[k], ct[k]);
+		}
+	};
+
+	/*
+     * number of touching pairs of the last resolve
+     */
+	int touching(void) {
+		return first[CONTACT_COLORS + 1];
+	};
+
+	/*
+     * number of colours used by the last resolve
+     */
+	int colors(void) {
+		int n = 0;
+		for (int c = 0; c <= CONTACT_COLORS; c++) {
+			if (first[c + 1] > first[c]) n = c + 1;
+		}
+		return n;
+	};
+
+	/*
+     * remove every pair. Must not run concurrently with push.
+     */
+	void clear(void) {
+		for (auto &slot : slots) {
+			slot.a.clear();
+			slot.b.clear();
+			slot.t.clear();
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef PERF_COUNTERS
+#define PERF_COUNTERS
+
+#include <atomic>
+#include <array>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "threadpool.h"
+#include "threadslot.h"
+
+/*
+ * Hardware event counts of the work done by a set of threads, read with
+ * Linux perf_event_open.
+ *
+ * Every thread opens its own group of counters the first time it counts,
+ * and counts between start and stop into its own slot. collect sums and
+ * empties the slots of every thread. As a TaskObserver of a pool it counts
+ * every task on the worker running it and pauses the waiting thread while
+ * it waits, so the spinning of idle workers is never counted.
+ *
+ * Events the kernel or the machine do not allow, for example in most
+ * containers and virtual machines, are reported as unsupported and read as
+ * 0. When no event is allowed, or on other systems, every call returns
+ * straight away.
+ */
+class PerfCounters : public TaskObserver {
+	public:
+
+	static const int EVENTS = 4;
+	enum Event { CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES };
+	typedef std::array<uint64_t, EVENTS> Values;
+
+	private:
+
+	struct alignas(64) Slot {
+		bool opened;
+		bool running;
+		bool paused;
+
+		// leader of the group and position of every event in a group
+		// read, -1 if the event could not be opened
+		int leader;
+		std::array<int, EVENTS> fd;
+		std::array<int, EVENTS> position;
+
+		Values start;
+
+		// counted since the last collect
+		std::array<std::atomic<uint64_t>, EVENTS> total;
+	};
+
+	std::array<Slot, MAX_THREAD_SLOTS> slots;
+
+	std::array<bool, EVENTS> supported;
+	bool enabled;
+	std::string reason;
+
+	/*
+     * open the group of the calling thread. Only events which opened on
+	 * the thread creating the counters are tried, which probes them.
+     */
+	void open(Slot &s, bool probe = false) {
+		s.opened = true;
+#ifdef __linux__
+		static const uint64_t config[EVENTS] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES,
+		};
+
+		int members = 0;
+		for (int e = 0; e < EVENTS; e++) {
+			if (!supported[e]) continue;
+
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = config[e];
+			attr.read_format = PERF_FORMAT_GROUP;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+
+			// this thread, any cpu
+			int fd = syscall(SYS_perf_event_open, &attr, 0, -1, s.leader, 0);
+			if (fd < 0) {
+				if (probe) {
+					supported[e] = false;
+					reason = std::strerror(errno);
+				}
+				continue;
+			}
+
+			if (s.leader < 0) s.leader = fd;
+			s.fd[e] = fd;
+			s.position[e] = members++;
+		}
+#else
+		supported.fill(false);
+		reason = "perf_event_open needs Linux";
+#endif
+	};
+
+	/*
+     * current values of the group of s
+     */
+	bool read(Slot &s, Values &v) {
+#ifdef __linux__
+		uint64_t buffer[1 + EVENTS];
+		if (::read(s.leader, buffer, sizeof(buffer)) <= 0) return false;
+		for (int e = 0; e < EVENTS; e++) {
+			v[e] = s.position[e] < 0 ? 0 : buffer[1 + s.position[e]];
+		}
+		return true;
+#else
+		return false;
+#endif
+	};
+
+	public:
+
+	/*
+     * opens the counters of the calling thread to find out which events
+	 * are allowed
+     */
+	PerfCounters() {
+		supported.fill(true);
+		for (auto &s : slots) {
+			s.opened = false;
+			s.running = false;
+			s.paused = false;
+			s.leader = -1;
+			s.fd.fill(-1);
+			s.position.fill(-1);
+			for (auto &t : s.total) t.store(0);
+		}
+
+		open(slots[thread_slot()], true);
+		enabled = slots[thread_slot()].leader >= 0;
+	};
+
+	~PerfCounters() {
+#ifdef __linux__
+		for (auto &s : slots) {
+			for (int fd : s.fd) {
+				if (fd >= 0) close(fd);
+			}
+		}
+#endif
+	};
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	/*
+     * true if at least one event can be counted
+     */
+	bool available(void) {
+		return enabled;
+	};
+
+	bool supports(Event e) {
+		return enabled && supported[e];
+	};
+
+	/*
+     * why the last event which failed could not be opened
+     */
+	const std::string& error(void) {
+		return reason;
+	};
+
+	/*
+     * start counting on the calling thread
+     */
+	void start(void) {
+		if (!enabled) return;
+
+		auto &s = slots[thread_slot()];
+		if (!s.opened) open(s);
+		if (s.leader < 0) return;
+		s.running = read(s, s.start);
+	};
+
+	/*
+     * stop counting on the calling thread, the counts since start are
+	 * added to its slot
+     */
+	void stop(void) {
+		if (!enabled) return;
+
+		auto &s = slots[thread_slot()];
+		if (!s.running) return;
+		s.running = false;
+
+		Values now;
+		if (!read(s, now)) return;
+		for (int e = 0; e < EVENTS; e++) {
+			s.total[e].fetch_add(now[e] - s.start[e], std::memory_order_relaxed);
+		}
+	};
+
+	/*
+     * add the counts of every thread since the last collect to v. Counts
+	 * of threads still counting are collected when they stop.
+     */
+	void collect(Values &v) {
+		for (auto &s : slots) {
+			for (int e = 0; e < EVENTS; e++) {
+				v[e] += s.total[e].exchange(0, std::memory_order_relaxed);
+			}
+		}
+	};
+
+	void task_begin(void) {
+		start();
+	};
+
+	void task_end(void) {
+		stop();
+	};
+
+	/*
+     * a counting thread pauses while it waits for the pool
+     */
+	void wait_begin(void) {
+		if (!enabled) return;
+
+		auto &s = slots[thread_slot()];
+		s.paused = s.running;
+		stop();
+	};
+
+	void wait_end(void) {
+		if (!enabled) return;
+
+		auto &s = slots[thread_slot()];
+		if (s.paused) start();
+		s.paused = false;
+	};
+};
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef PROFILER
+#define PROFILER
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <algorithm>
+#include <string>
+
+#include "perf_counters.h"
+
+/*
+ * Histogram of non-negative integer samples.
+ *
+ * Values below 8 have a bucket each, larger values are split into 8
+ * buckets per power of two, so percentiles are within 12.5% of the true
+ * value. Samples may be recorded and read from any thread without locks,
+ * a read concurrent with records sees some of them.
+ */
+class Histogram {
+	static const int SUB_BITS = 3;
+	static const int SUB = 1 << SUB_BITS;
+
+	std::array<std::atomic<uint64_t>, 64 * SUB> counts;
+	std::atomic<uint64_t> samples;
+	std::atomic<uint64_t> largest;
+
+	static int bucket(uint64_t v) {
+		if (v < SUB) return v;
+		int e = 63 - __builtin_clzll(v);
+		int sub = (v >> (e - SUB_BITS)) & (SUB - 1);
+		return (e - SUB_BITS + 1) * SUB + sub;
+	};
+
+	/*
+     * largest value falling into bucket b
+     */
+	static uint64_t upper(int b) {
+		if (b < SUB) return b;
+		int e = b / SUB + SUB_BITS - 1;
+		uint64_t sub = b % SUB;
+		return ((SUB + sub + 1) << (e - SUB_BITS)) - 1;
+	};
+
+	public:
+
+	Histogram() {
+		reset();
+	};
+
+	void record(uint64_t v) {
+		counts[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+		samples.fetch_add(1, std::memory_order_relaxed);
+
+		auto m = largest.load(std::memory_order_relaxed);
+		while (v > m && !largest.compare_exchange_weak(m, v, std::memory_order_relaxed));
+	};
+
+	uint64_t count(void) {
+		return samples.load(std::memory_order_relaxed);
+	};
+
+	uint64_t max(void) {
+		return largest.load(std::memory_order_relaxed);
+	};
+
+	/*
+     * smallest bucket bound below which a fraction q of the samples fall,
+	 * 0 if there are none
+     */
+	uint64_t percentile(double q) {
+		uint64_t n = count();
+		if (n == 0) return 0;
+
+		uint64_t target = std::max<uint64_t>(1, q * n + 0.5);
+		uint64_t seen = 0;
+		for (int b = 0; b < (int) counts.size(); b++) {
+			seen += counts[b].load(std::memory_order_relaxed);
+			if (seen >= target) return std::min(upper(b), max());
+		}
+		return max();
+	};
+
+	/*
+     * Must not run concurrently with record
+     */
+	void reset(void) {
+		for (auto &c : counts) c.store(0);
+		samples.store(0);
+		largest.store(0);
+	};
+};
+
+/*
+ * Time of every phase of a frame and counts per frame, such as the number
+ * of pairs, kept as histograms over all frames.
+ *
+ * The thread running the frame calls begin, then lap at the end of every
+ * phase and count as often as needed, then end. Phases may repeat within a
+ * frame, as they do with substeps, their times are summed. Any thread may
+ * print or export the histograms while frames run.
+ *
+ * With hardware counters, see use, the events of the thread running the
+ * frame and of the pool tasks it waited for are summed per phase.
+ */
+class Profiler {
+	typedef std::chrono::steady_clock Clock;
+
+	std::vector<const char*> phase_names;
+	std::vector<const char*> counter_names;
+
+	// times in ns and counts over all frames
+	std::vector<Histogram> phases;
+	std::vector<Histogram> counters;
+	Histogram frames;
+
+	// the frame being recorded
+	std::vector<uint64_t> phase_time;
+	std::vector<uint64_t> counter_value;
+	Clock::time_point start;
+	Clock::time_point last;
+
+	// hardware events of every phase summed over all frames, null if not
+	// counted
+	PerfCounters *perf;
+	std::vector<std::array<std::atomic<uint64_t>, PerfCounters::EVENTS>> events;
+
+	/*
+     * name, samples and percentiles of one histogram, scaled by unit
+     */
+	void row(std::ostream &out, const char *name, Histogram &h, double unit) {
+		char line[128];
+		snprintf(line, sizeof(line), "%-12s %8lu %10.1f %10.1f %10.1f %10.1f\n", name,
+				(unsigned long) h.count(), h.percentile(0.5) / unit, h.percentile(0.9) / unit,
+				h.percentile(0.99) / unit, h.max() / unit);
+		out << line;
+	};
+
+	std::string value(int phase, PerfCounters::Event e, uint64_t frames) {
+		char text[32];
+		if (perf->supports(e)) snprintf(text, sizeof(text), " %12.0f", (double) events[phase][e].load() / frames);
+		else snprintf(text, sizeof(text), " %12s", "-");
+		return text;
+	};
+
+	std::string ipc(int phase) {
+		char text[32];
+		double cycles = events[phase][PerfCounters::CYCLES].load();
+		double instructions = events[phase][PerfCounters::INSTRUCTIONS].load();
+		if (perf->supports(PerfCounters::CYCLES) && perf->supports(PerfCounters::INSTRUCTIONS) && cycles > 0) {
+			snprintf(text, sizeof(text), " %6.2f", instructions / cycles);
+		} else {
+			snprintf(text, sizeof(text), " %6s", "-");
+		}
+		return text;
+	};
+
+	void object(std::ostream &out, const char *name, Histogram &h, bool comma) {
+		out << "    \"" << name << "\": {\"count\": " << h.count()
+			<< ", \"p50\": " << h.percentile(0.5) << ", \"p90\": " << h.percentile(0.9)
+			<< ", \"p99\": " << h.percentile(0.99) << ", \"max\": " << h.max() << "}"
+			<< (comma ? ",\n" : "\n");
+	};
+
+	public:
+
+	Profiler(std::vector<const char*> phase, std::vector<const char*> counter)
+		: phase_names(phase), counter_names(counter), phases(phase.size()), counters(counter.size()),
+		  phase_time(phase.size(), 0), counter_value(counter.size(), 0), perf(nullptr), events(phase.size()) {
+		for (auto &e : events) {
+			for (auto &v : e) v.store(0);
+		}
+	};
+
+	/*
+     * Count hardware events per phase with counters, which must also
+	 * observe the pool running the tasks of the frame. Must not run
+	 * concurrently with a frame.
+     */
+	void use(PerfCounters *counters) {
+		perf = counters;
+	};
+
+	/*
+     * start a frame
+     */
+	void begin(void) {
+		std::fill(phase_time.begin(), phase_time.end(), 0);
+		std::fill(counter_value.begin(), counter_value.end(), 0);
+		start = Clock::now();
+		last = start;
+
+		if (perf) {
+			// drop events counted outside of frames
+			PerfCounters::Values v = {};
+			perf->collect(v);
+			perf->start();
+		}
+	};
+
+	/*
+     * end a phase, the time since the last lap or begin is added to it
+     */
+	void lap(int phase) {
+		auto now = Clock::now();
+		phase_time[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+		last = now;
+
+		if (perf) {
+			PerfCounters::Values v = {};
+			perf->stop();
+			perf->collect(v);
+			for (int e = 0; e < PerfCounters::EVENTS; e++) {
+				events[phase][e].fetch_add(v[e], std::memory_order_relaxed);
+			}
+			perf->start();
+		}
+	};
+
+	void count(int counter, long n) {
+		counter_value[counter] += n;
+	};
+
+	/*
+     * end the frame and record it, phases which did not run this frame are
+	 * not recorded
+     */
+	void end(void) {
+		if (perf) perf->stop();
+
+		auto now = Clock::now();
+		frames.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count());
+		for (int i = 0; i < (int) phases.size(); i++) {
+			if (phase_time[i]) phases[i].record(phase_time[i]);
+		}
+		for (int i = 0; i < (int) counters.size(); i++) counters[i].record(counter_value[i]);
+	};
+
+	/*
+     * table of the phases in us, then of the counts, then of the mean
+	 * hardware events per frame if counted
+     */
+	void print(std::ostream &out) {
+		char line[128];
+		snprintf(line, sizeof(line), "%-12s %8s %10s %10s %10s %10s\n", "phase us", "frames",
+				"p50", "p90", "p99", "max");
+		out << line;
+		for (int i = 0; i < (int) phases.size(); i++) row(out, phase_names[i], phases[i], 1e3);
+		row(out, "frame", frames, 1e3);
+		for (int i = 0; i < (int) counters.size(); i++) row(out, counter_names[i], counters[i], 1.0);
+		if (!perf) return;
+
+		// mean events per frame, - for events which are not counted
+		snprintf(line, sizeof(line), "\n%-12s %12s %12s %6s %12s %12s\n", "phase", "cycles",
+				"instructions", "ipc", "cache miss", "branch miss");
+		out << line;
+		for (int i = 0; i < (int) phases.size(); i++) {
+			auto frames = phases[i].count();
+			if (frames == 0) continue;
+
+			snprintf(line, sizeof(line), "%-12s", phase_names[i]);
+			out << line;
+			for (int e = 0; e < PerfCounters::EVENTS; e++) {
+				if (e == PerfCounters::CACHE_MISSES) out << ipc(i);
+				out << value(i, (PerfCounters::Event) e, frames);
+			}
+			out << "\n";
+		}
+	};
+
+	/*
+     * the histograms as JSON, times in ns
+     */
+	void json(std::ostream &out) {
+		out << "{\n  \"phases\": {\n";
+		for (int i = 0; i < (int) phases.size(); i++) object(out, phase_names[i], phases[i], true);
+		object(out, "frame", frames, false);
+		out << "  },\n  \"counters\": {\n";
+		for (int i = 0; i < (int) counters.size(); i++) {
+			object(out, counter_names[i], counters[i], i + 1 < (int) counters.size());
+		}
+		out << "  }";
+
+		// events summed over all frames, null if not counted
+		if (perf) {
+			static const char *names[PerfCounters::EVENTS] = {
+				"cycles", "instructions", "cache_misses", "branch_misses"
+			};
+			out << ",\n  \"events\": {\n";
+			for (int i = 0; i < (int) phases.size(); i++) {
+				out << "    \"" << phase_names[i] << "\": {";
+				for (int e = 0; e < PerfCounters::EVENTS; e++) {
+					out << "\"" << names[e] << "\": ";
+					if (perf->supports((PerfCounters::Event) e)) out << events[i][e].load();
+					else out << "null";
+					out << (e + 1 < PerfCounters::EVENTS ? ", " : "");
+				}
+				out << "}" << (i + 1 < (int) phases.size() ? ",\n" : "\n");
+			}
+			out << "  }";
+		}
+		out << "\n}\n";
+	};
+
+	/*
+     * Must not run concurrently with a frame
+     */
+	void reset(void) {
+		for (auto &h : phases) h.reset();
+		for (auto &h : counters) h.reset();
+		frames.reset();
+		for (auto &e : events) {
+			for (auto &v : e) v.store(0);
+		}
+	};
+};
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef QUADTREE_LOCKFREE
+#define QUADTREE_LOCKFREE
+
+#include <atomic>
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+
+#include "threadpool.h"
+
+/*
+ * QuadRef combines a counter and an index together, same as TaskRef.
+ * - 32 bit counter
+ * - 32 bit index
+ *
+ * indices start from 1, 0 is reserved for null
+ */
+typedef uint64_t QuadRef;
+
+/*
+ * item value of a link whose entity has moved away
+ */
+const uint32_t QUAD_TOMBSTONE = 0xFFFFFFFF;
+
+/*
+ * entity stored in the tree, the index of an item is its handle
+ */
+struct QuadItem {
+	int eid;
+
+	// AABB of the entity
+	float x1, y1;
+	float x2, y2;
+
+	// tree node and link the item is stored in
+	uint32_t node;
+	uint32_t link;
+
+	// next free item
+	uint32_t next;
+};
+
+/*
+ * linked list of all items within a tree node
+ */
+struct QuadLink {
+	std::atomic<uint32_t> item;
+	uint32_t next;
+};
+
+/*
+ * Loose quadtree over a square world.
+ *
+ * Nodes of every level are stored in one flat array, level by level. The
+ * bounds of a node are loosened by half a cell on every side, so an entity
+ * only needs the node containing its center on the deepest level where the
+ * node is at least as large as the entity. Insertion never walks the tree.
+ *
+ * Items live in exactly one node, so queries report every pair once without
+ * deduplication. Insert, update and remove may run concurrently with each
+ * other, queries may run concurrently with each other.
+ *
+ * Warning - every update which changes nodes and every remove leaves a dead
+ * link behind, which only purge returns. There are max_items spare links,
+ * once they are used up insert and update wait forever for a free link.
+ * Call purge regularly, for example once per frame.
+ */
+class QuadTreeLF {
+	// lower corner and side length of the world
+	float x0, y0;
+	float size;
+
+	// number of levels
+	int depth;
+
+	// index of the first node of every level
+	std::vector<uint32_t> level_start;
+
+	// list of links per node
+	std::vector<std::atomic<uint32_t>> heads;
+
+	// number of items per level, queries skip empty levels
+	std::vector<std::atomic<int>> level_items;
+
+	std::vector<QuadItem> items;
+	std::vector<QuadLink> links;
+
+	std::atomic<QuadRef> free_items;
+	std::atomic<QuadRef> free_links;
+
+	// number of tombstones waiting for purge
+	std::atomic<int> dead;
+
+	/*
+	 * pop an index from one of the free lists
+	 */
+	template<class T>
+	uint32_t allocate(std::atomic<QuadRef> &free, std::vector<T> &pool) {
+		while (true) {
+			auto ref = free.load();
+			uint32_t index = ref & 0x00000000FFFFFFFF;
+
+			// free list is empty, wait for a free
+			if (index == 0) continue;
+
+			auto counter = ref >> 32;
+			QuadRef new_ref = ((counter + 1) << 32) | pool[index].next;
+
+			bool s = free.compare_exchange_strong(ref, new_ref);
+			if (s) return index;
+		}
+	};
+
+	/*
+	 * push an index onto one of the free lists
+	 */
+	template<class T>
+	void recycle(std::atomic<QuadRef> &free, std::vector<T> &pool, uint32_t index) {
+		while (true) {
+			auto ref = free.load();
+			pool[index].next = ref & 0x00000000FFFFFFFF;
+
+			auto counter = ref >> 32;
+			QuadRef new_ref = ((counter + 1) << 32) | index;
+
+			bool s = free.compare_exchange_strong(ref, new_ref);
+			if (s) break;
+		}
+	};
+
+	/*
+	 * side length of a node on a level
+	 */
+	float cell_size(int level) {
+		return size / (1 << level);
+	};
+
+	/*
+	 * map a coordinate to a row or column of a level, clamped to the world
+	 */
+	int cell(float p, float p0, int level) {
+		int n = 1 << level;
+		int c = std::floor((p - p0) / cell_size(level));
+		return std::min(std::max(c, 0), n - 1);
+	};
+
+	/*
+	 * node which stores an AABB
+	 */
+	uint32_t find_node(float x1, float y1, float x2, float y2) {
+		auto extent = std::max(x2 - x1, y2 - y1);
+
+		// deepest level whose nodes are as large as the entity
+		int level = 0;
+		while (level < depth - 1 && cell_size(level + 1) >= extent) level++;
+
+		auto row = cell((y1 + y2) * 0.5f, y0, level);
+		auto col = cell((x1 + x2) * 0.5f, x0, level);
+		return level_start[level] + row * (1 << level) + col;
+	};
+
+	/*
+	 * level of a node
+	 */
+	int node_level(uint32_t node) {
+		int level = 0;
+		while (level < depth - 1 && level_start[level + 1] <= node) level++;
+		return level;
+	};
+
+	/*
+	 * push an item into a node
+	 */
+	void link(uint32_t index, uint32_t node) {
+		auto l = allocate(free_links, links);
+		links[l].item.store(index);
+
+		auto &head = heads[node];
+		while (true) {
+			auto old_head = head.load();
+			links[l].next = old_head;
+			bool s = head.compare_exchange_strong(old_head, l);
+			if (s) break;
+		}
+
+		items[index].node = node;
+		items[index].link = l;
+		level_items[node_level(node)].fetch_add(1);
+	};
+
+	/*
+	 * tombstone the link of an item, purge unlinks it later
+	 */
+	void unlink(uint32_t index) {
+		links[items[index].link].item.store(QUAD_TOMBSTONE);
+		level_items[node_level(items[index].node)].fetch_sub(1);
+		dead.fetch_add(1);
+	};
+
+	/*
+	 * report every item in a node overlapping the item at index
+	 */
+	void query_node(uint32_t index, uint32_t node, std::function<void(int,int)> &func) {
+		auto &a = items[index];
+
+		for (auto l = heads[node].load(); l; l = links[l].next) {
+			auto other = links[l].item.load();
+			if (other == QUAD_TOMBSTONE) continue;
+
+			auto &b = items[other];
+
+			// ignore symmetric collisons and collisions with self
+			if (b.eid <= a.eid) continue;
+
+			// AABB overlap
+			if (a.x1 > b.x2 || b.x1 > a.x2) continue;
+			if (a.y1 > b.y2 || b.y1 > a.y2) continue;
+
+			func(a.eid, b.eid);
+		}
+	};
+
+	/*
+	 * visits every node on every level whose loose bounds overlap the AABB
+	 * of an item and reports entities whose AABB overlaps.
+	 */
+	void query_item(uint32_t index, std::function<void(int,int)> &func) {
+		auto &item = items[index];
+
+		for (int level = 0; level < depth; level++) {
+			if (level_items[level].load(std::memory_order_relaxed) == 0) continue;
+
+			// loose bounds extend half a cell outwards
+			auto half = cell_size(level) * 0.5f;
+			auto row1 = cell(item.y1 - half, y0, level);
+			auto col1 = cell(item.x1 - half, x0, level);
+			auto row2 = cell(item.y2 + half, y0, level);
+			auto col2 = cell(item.x2 + half, x0, level);
+
+			int n = 1 << level;
+			for (auto i = row1; i <= row2; i++) {
+				for (auto j = col1; j <= col2; j++) {
+					query_node(index, level_start[level] + i * n + j, func);
+				}
+			}
+		}
+	};
+
+	/*
+	 * query every item stored in a node
+	 */
+	void query_items(uint32_t node, std::function<void(int,int)> &func) {
+		for (auto l = heads[node].load(); l; l = links[l].next) {
+			auto index = links[l].item.load();
+			if (index == QUAD_TOMBSTONE) continue;
+			query_item(index, func);
+		}
+	};
+
+	/*
+	 * query every item in the subtree of a node on level split, excluding
+	 * items stored above the split level
+	 */
+	void query_subtree(int split, int row, int col, std::function<void(int,int)> func) {
+		for (int level = split; level < depth; level++) {
+			int n = 1 << level;
+			int scale = 1 << (level - split);
+			for (int i = row * scale; i < (row + 1) * scale; i++) {
+				for (int j = col * scale; j < (col + 1) * scale; j++) {
+					query_items(level_start[level] + i * n + j, func);
+				}
+			}
+		}
+	};
+
+	public:
+
+	/*
+	 * the world is the square from x, y to x + s, y + s. Entities outside
+	 * the world are kept in the border nodes.
+	 */
+	QuadTreeLF(float x, float y, float s, int d = 8, int max_items = 102400) {
+		x0 = x;
+		y0 = y;
+		size = s;
+		depth = d;
+
+		uint32_t total = 0;
+		for (int level = 0; level < depth; level++) {
+			level_start.push_back(total);
+			total += (1 << level) * (1 << level);
+		}
+
+		heads = std::vector<std::atomic<uint32_t>>(total);
+		for (auto &head : heads) head.store(0);
+
+		level_items = std::vector<std::atomic<int>>(depth);
+		for (auto &count : level_items) count.store(0);
+
+		// index 0 is reserved for null
+		items.resize(max_items + 1);
+		links = std::vector<QuadLink>(2 * max_items + 1);
+
+		free_items.store(0);
+		free_links.store(0);
+		dead.store(0);
+
+		// initialize free lists
+		for (uint32_t i = 1; i < items.size(); i++) recycle(free_items, items, i);
+		for (uint32_t i = 1; i < links.size(); i++) recycle(free_links, links, i);
+	};
+
+	/*
+     * Insert an entity into the tree
+	 *
+	 * Input is an EntityID and an AABB bounding box representing the object.
+	 * the function assumes x1, y1 is less than x2, y2.
+	 *
+ 	 * returns a handle to the entity
+     */
+	uint32_t insert(int eid, float x1, float y1, float x2, float y2) {
+		auto index = allocate(free_items, items);
+		auto &item = items[index];
+
+		item.eid = eid;
+		item.x1 = x1;
+		item.y1 = y1;
+		item.x2 = x2;
+		item.y2 = y2;
+
+		link(index, find_node(x1, y1, x2, y2));
+		return index;
+	};
+
+	/*
+     * Move an entity to a new AABB, the entity only changes nodes when its
+	 * center leaves the node or its size no longer matches the level. A
+	 * change of nodes takes a link which is not returned until purge.
+     */
+	void update(uint32_t index, float x1, float y1, float x2, float y2) {
+		auto &item = items[index];
+		auto node = find_node(x1, y1, x2, y2);
+
+		item.x1 = x1;
+		item.y1 = y1;
+		item.x2 = x2;
+		item.y2 = y2;
+
+		if (node == item.node) return;
+
+		unlink(index);
+		link(index, node);
+	};
+
+	/*
+     * Remove an entity from the tree, its handle becomes invalid
+     */
+	void remove(uint32_t index) {
+		unlink(index);
+		recycle(free_items, items, index);
+	};
+
+	/*
+     * Unlink the links left behind by update and remove. Must not run
+	 * concurrently with any other operation.
+     */
+	void purge(void) {
+		if (dead.load() == 0) return;
+
+		for (auto &head : heads) {
+			uint32_t prev = 0;
+			auto curr = head.load();
+			while (curr) {
+				auto next = links[curr].next;
+				if (links[curr].item.load() == QUAD_TOMBSTONE) {
+					if (prev) links[prev].next = next;
+					else head.store(next);
+					recycle(free_links, links, curr);
+				} else {
+					prev = curr;
+				}
+				curr = next;
+			}
+		}
+		dead.store(0);
+	};
+
+	/*
+     * query possible collisions from a given handle
+     */
+	void query_callback(uint32_t index, std::function<void(int,int)> func) {
+		query_item(index, func);
+	};
+
+	/*
+     * query every entity in the tree in parallel.
+	 *
+	 * one task is issued per subtree on the split level, plus one for the
+	 * entities stored above it.
+     */
+	void query_all(ThreadPool &pool, std::function<void(int,int)> func, int split = 2) {
+		split = std::min(split, depth - 1);
+
+		pool.add([this, split, func] {
+			auto f = func;
+			for (uint32_t node = 0; node < level_start[split]; node++) {
+				query_items(node, f);
+			}
+		}, "QuadTreeLF::query_all");
+
+		int n = 1 << split;
+		for (int i = 0; i < n; i++) {
+			for (int j = 0; j < n; j++) {
+				pool.add([this, split, i, j, func] { query_subtree(split, i, j, func); }, "QuadTreeLF::query_subtree");
+			}
+		}
+		pool.wait("QuadTreeLF::query_all");
+	};
+
+	/*
+     * print the contents of the nodes
+     */
+	void print(void) {
+		for (int level = 0; level < depth; level++) {
+			auto end = level + 1 < depth ? level_start[level + 1] : heads.size();
+			for (auto node = level_start[level]; node < end; node++) {
+				for (auto l = heads[node].load(); l; l = links[l].next) {
+					auto index = links[l].item.load();
+					if (index == QUAD_TOMBSTONE) continue;
+					std::cout << "level " << level << " node " << node;
+					std::cout << " item " << items[index].eid << std::endl;
+				}
+			}
+		}
+	};
+};
+
+#endif
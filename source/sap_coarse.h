@@ -4,6 +4,7 @@
 #include <limits>
 #include <iostream>
 #include <mutex>
+#include <functional>
 
 /*
  * Node which store the ID, position, and width of an object.
@@ -121,6 +122,18 @@ class SapListC {
 		}
 	};
 
+	/*
+     * find all nodes that intersect the object
+     */
+	void query_callback(SapNodeC *node, std::function<void(int,int)> func) {
+		auto curr = node->next;
+		while (node->position + node->width >= curr->position) {
+			// callback
+			func(node->eid, curr->eid);
+			curr = curr->next;
+		}
+	};
+
 	/*
      * print current state of list
      */
@@ -4,7 +4,10 @@
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <iostream>
+#include <algorithm>
 
 /*
  * Task Reference combines a counter and an index together. The counter is
@@ -25,12 +28,48 @@ class TaskNode {
 	std::function<void()> task;
 	TaskRef next;
 
+	// name of the task in a trace, null if none was given
+	const char *label;
+
 	TaskNode() {
 		task = nullptr;
 		next = 0;
+		label = nullptr;
 	}
 };
 
+/*
+ * task run by a worker, or a wait, in a trace. Times in ns since tracing
+ * started.
+ */
+struct TraceEvent {
+	const char *label;
+	int64_t begin;
+	int64_t end;
+};
+
+/*
+ * Last events of one thread. Only that thread writes, the ring is
+ * allocated when tracing starts and never grows.
+ */
+struct alignas(64) TraceRing {
+	std::vector<TraceEvent> events;
+	uint64_t written;
+};
+
+/*
+ * Notified around every task on the worker running it, and around wait on
+ * the waiting thread. Used to measure the work of tasks, see
+ * ThreadPool::observe.
+ */
+class TaskObserver {
+	public:
+	virtual void task_begin(void) = 0;
+	virtual void task_end(void) = 0;
+	virtual void wait_begin(void) = 0;
+	virtual void wait_end(void) = 0;
+};
+
 /*
  * Simple thread pool class which recylces old threads. It's expensive
  * to recreate threads over and over. Threads will compete for task nodes
@@ -58,6 +97,25 @@ class ThreadPool {
 	// free list which stores old nodes
 	std::atomic<TaskRef> free;
 
+	// notified around tasks and waits, null if none
+	std::atomic<TaskObserver*> observer;
+
+	// one ring per worker, then one for the thread calling wait
+	std::atomic<bool> tracing;
+	std::vector<TraceRing> rings;
+	std::chrono::steady_clock::time_point trace_start;
+
+	int64_t trace_time(void) {
+		auto d = std::chrono::steady_clock::now() - trace_start;
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+	};
+
+	void record(int ring, const char *label, int64_t begin, int64_t end) {
+		auto &r = rings[ring];
+		r.events[r.written % r.events.size()] = {label, begin, end};
+		r.written++;
+	};
+
 
 	/*
      * Extract node from a reference and return a new reference
@@ -91,7 +149,7 @@ class ThreadPool {
 	/*
      * Main loop for every worker thread.
      */
-	void worker_func(void) {
+	void worker_func(int worker) {
 		while (true) {
 			if (quit) break;
 			if (pause) continue;
@@ -110,9 +168,16 @@ class ThreadPool {
 			if (!succ) continue;
 
 			auto &node = taskpool[index];
+			auto *o = observer.load(std::memory_order_relaxed);
+			bool traced = tracing.load(std::memory_order_relaxed);
+			int64_t begin = traced ? trace_time() : 0;
 
 			// execute task
+			if (o) o->task_begin();
 			node.task();
+			if (o) o->task_end();
+
+			if (traced) record(worker, node.label, begin, trace_time());
 
 			recycleNode(index);
 
@@ -152,6 +217,7 @@ class ThreadPool {
 
 		// wipe node
 		node.task = nullptr;
+		node.label = nullptr;
 		while (true) {
 			auto ref = free.load();
 			node.next = ref;
@@ -170,6 +236,8 @@ class ThreadPool {
 		taskpool.resize(10000);
 
 		quit.store(false);
+		observer.store(nullptr);
+		tracing.store(false);
 		head.store(0);
 		free.store(0);
 		issued.store(0);
@@ -187,8 +255,8 @@ class ThreadPool {
      */
 	void start(void) {
 		pause.store(true);
-		for (auto &thread : pool) {
-			thread = std::thread([this] { worker_func(); });
+		for (int i = 0; i < (int) pool.size(); i++) {
+			pool[i] = std::thread([this, i] { worker_func(i); });
 		}
 		pause.store(false);
 	};
@@ -204,13 +272,15 @@ class ThreadPool {
 	};
 
 	/*
-     * Insert task into task pool
+     * Insert task into task pool, label names it in a trace and must
+	 * outlive the trace
      */
-	void add(std::function<void()> func) {
+	void add(std::function<void()> func, const char *label = nullptr) {
 		auto index = allocateNode();
 		auto &node = taskpool[index];
 
 		node.task = func;
+		node.label = label;
 
 		while (true) {
 			auto ref = head.load();
@@ -230,8 +300,76 @@ class ThreadPool {
 	/*
      * Main thread waits until tasks are completed
      */
-	void wait(void) {
+	void wait(const char *label = "wait") {
+		auto *o = observer.load(std::memory_order_relaxed);
+		bool traced = tracing.load(std::memory_order_relaxed);
+		int64_t begin = traced ? trace_time() : 0;
+
+		if (o) o->wait_begin();
 		while (completed < issued);
+		if (o) o->wait_end();
+
+		if (traced) record(pool.size(), label, begin, trace_time());
+	};
+
+	/*
+     * notify o around every task and wait from now on, null to stop
+     */
+	void observe(TaskObserver *o) {
+		observer.store(o);
+	};
+
+	/*
+     * Start recording every task and wait into rings of the last capacity
+	 * events of each thread, or stop recording. A capacity below 1 keeps a
+	 * single event. Waits must be called from one thread while tracing.
+	 * Must not run concurrently with tasks.
+     */
+	void trace(bool on, int capacity = 65536) {
+		if (on) {
+			// events are written at written % capacity
+			capacity = std::max(capacity, 1);
+			rings = std::vector<TraceRing>(pool.size() + 1);
+			for (auto &r : rings) {
+				r.events.resize(capacity);
+				r.written = 0;
+			}
+			trace_start = std::chrono::steady_clock::now();
+		}
+		tracing.store(on);
+	};
+
+	/*
+     * Write the recorded events as Chrome trace event JSON, viewable in
+	 * chrome://tracing or Perfetto. Must not run concurrently with tasks.
+     */
+	void dump_trace(std::ostream &out) {
+		out << "{\"traceEvents\": [\n";
+		bool first = true;
+		for (int t = 0; t < (int) rings.size(); t++) {
+			// name the thread
+			if (!first) out << ",\n";
+			first = false;
+			out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << t
+				<< ", \"args\": {\"name\": \"";
+			if (t < (int) pool.size()) out << "worker " << t;
+			else out << "wait";
+			out << "\"}}";
+
+			auto &r = rings[t];
+			uint64_t n = r.events.size();
+			uint64_t oldest = r.written > n ? r.written - n : 0;
+			for (uint64_t k = oldest; k < r.written; k++) {
+				auto &e = r.events[k % n];
+
+				// complete event, times in us
+				char times[64];
+				snprintf(times, sizeof(times), "\"ts\": %.3f, \"dur\": %.3f", e.begin / 1e3, (e.end - e.begin) / 1e3);
+				out << ",\n{\"name\": \"" << (e.label ? e.label : "task")
+					<< "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << t << ", " << times << "}";
+			}
+		}
+		out << "\n]}\n";
 	};
 };
 
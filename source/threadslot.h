@@ -0,0 +1,22 @@
+#ifndef THREAD_SLOT
+#define THREAD_SLOT
+
+#include <atomic>
+
+/*
+ * maximum number of threads owning per thread data. Threads beyond this
+ * share slots with earlier threads, which per thread data does not allow.
+ */
+const int MAX_THREAD_SLOTS = 128;
+
+/*
+ * small dense id of the calling thread, assigned on first use.
+ * used to index per thread data stored in an array.
+ */
+inline int thread_slot(void) {
+	static std::atomic<int> next(0);
+	thread_local int slot = next.fetch_add(1) % MAX_THREAD_SLOTS;
+	return slot;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef VISITED_SET
+#define VISITED_SET
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+
+/*
+ * Set of non negative ids which is emptied in O(1) by bumping an epoch.
+ *
+ * An id is in the set when its stamp equals the current epoch. Every thread
+ * owns one set (see local) so concurrent queries never share scratch memory
+ * and never allocate once the stamps have grown to the largest id.
+ */
+class VisitedSet {
+	std::vector<uint32_t> stamps;
+	uint32_t epoch;
+
+	public:
+
+	VisitedSet() {
+		epoch = 0;
+	};
+
+	/*
+	 * start a new query, every id becomes unvisited
+	 */
+	void reset(void) {
+		epoch++;
+
+		// epoch wrapped around, old stamps could match again
+		if (epoch == 0) {
+			std::fill(stamps.begin(), stamps.end(), 0);
+			epoch = 1;
+		}
+	};
+
+	/*
+	 * mark id as visited, returns false if it already was
+	 */
+	bool insert(int id) {
+		assert(id >= 0);
+		auto i = (size_t) id;
+		if (i >= stamps.size()) stamps.resize(2 * i + 1, 0);
+
+		if (stamps[i] == epoch) return false;
+		stamps[i] = epoch;
+		return true;
+	};
+
+	/*
+	 * set owned by the calling thread.
+	 * queries using it must not be nested on the same thread.
+	 */
+	static VisitedSet& local(void) {
+		thread_local VisitedSet set;
+		return set;
+	};
+};
+
+#endif